@@ -0,0 +1,234 @@
+#!/usr/bin/env python
+"""
+Bootloader Footprint Report
+
+Prints a per-function report of the bootloader build and fails if it is over
+budget:
+  - code size of each function (symbol sizes from the .elf) and of each object
+    file (.text input sections listed in bootloader.map),
+  - static SRAM used by each variable in .data and .bss,
+  - worst-case stack depth of each function, from the -fstack-usage (.su)
+    files and the call graph recovered from the disassembly.
+
+The stack budget is what the bootloader keeps free below the stack for its
+own calls (STACK_RESERVE in bootloader.c); the rest of SRAM above the heap is
+used as the frame buffer, so going over it corrupts frames rather than
+crashing outright.
+"""
+from __future__ import print_function
+
+import argparse
+import glob
+import os
+import re
+import subprocess
+import sys
+
+# Bytes pushed by a call (return address) on a part with 128 KB of flash.
+CALL_SIZE = 2
+
+# Symbols reached by jumps that are not calls into another function.
+IGNORED_TARGETS = ('__prologue_saves__', '__epilogue_restores__')
+
+FUNC_RE = re.compile(r'^[0-9a-f]+ <([^>]+)>:$')
+CALL_RE = re.compile(r'\t(r?call|callq?)\s.*<([^>+]+)>')
+JUMP_RE = re.compile(r'\t(r?jmp|jmpq?)\s.*<([^>+]+)>')
+ICALL_RE = re.compile(r'\t(e?icall|e?ijmp)\b')
+MAP_TEXT_RE = re.compile(r'^ \.text\S*\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S+\.o)$')
+
+
+def run(cmd):
+    return subprocess.check_output(cmd).decode('ascii', 'replace')
+
+
+def read_symbols(nm, elf):
+    """
+    Return {name : size} for functions and for variables in SRAM.
+    """
+    funcs = {}
+    data = {}
+    for line in run([nm, '-S', '--size-sort', elf]).splitlines():
+        fields = line.split()
+        if len(fields) != 4:
+            continue
+        addr, size, kind, name = fields
+        if kind in 'tT':
+            funcs[name] = int(size, 16)
+        elif kind in 'bBdD':
+            data[name] = int(size, 16)
+    return funcs, data
+
+
+def read_sections(size, elf):
+    """
+    Return {section : bytes} for the output sections of the .elf.
+    """
+    sections = {}
+    for line in run([size, '-A', elf]).splitlines():
+        fields = line.split()
+        if len(fields) == 3 and fields[0].startswith('.') and fields[1].isdigit():
+            sections[fields[0]] = int(fields[1])
+    return sections
+
+
+def read_objects(mapfile):
+    """
+    Return {object file : .text bytes} from the linker map.
+    """
+    objects = {}
+    with open(mapfile) as f:
+        for line in f:
+            m = MAP_TEXT_RE.match(line.rstrip())
+            if m and int(m.group(2), 16):
+                obj = os.path.basename(m.group(3))
+                objects[obj] = objects.get(obj, 0) + int(m.group(2), 16)
+    return objects
+
+
+def read_stack_usage(sudir):
+    """
+    Return {function : (frame bytes, qualifier)} from the .su files.
+    """
+    frames = {}
+    for path in glob.glob(os.path.join(sudir, '*.su')):
+        with open(path) as f:
+            for line in f:
+                fields = line.rstrip().split('\t')
+                if len(fields) != 3:
+                    continue
+                name = fields[0].split(':')[-1]
+                frames[name] = (int(fields[1]), fields[2])
+    return frames
+
+
+def read_call_graph(objdump, elf):
+    """
+    Return {function : set of (callee, is_call)} and the set of functions
+    that make indirect calls.
+    """
+    graph = {}
+    indirect = set()
+    func = None
+    for line in run([objdump, '-d', elf]).splitlines():
+        m = FUNC_RE.match(line)
+        if m:
+            func = m.group(1)
+            graph.setdefault(func, set())
+            continue
+        if func is None:
+            continue
+
+        m = CALL_RE.search(line)
+        if m:
+            graph[func].add((m.group(2), True))
+            continue
+
+        m = JUMP_RE.search(line)
+        if m and m.group(2) != func and m.group(2) not in IGNORED_TARGETS:
+            # Tail call: reuses the caller's return address.
+            graph[func].add((m.group(2), False))
+            continue
+
+        if ICALL_RE.search(line):
+            indirect.add(func)
+    return graph, indirect
+
+
+def stack_depth(func, graph, frames, memo, path, problems):
+    """
+    Worst-case bytes of stack used by func and everything it calls.
+    """
+    if func in memo:
+        return memo[func]
+    if func in path:
+        problems.add("recursion through {}".format(func))
+        return 0
+
+    frame, qualifier = frames.get(func, (0, 'static'))
+    if qualifier != 'static':
+        problems.add("{} has a {} stack frame".format(func, qualifier))
+
+    path.add(func)
+    deepest = 0
+    for callee, is_call in graph.get(func, ()):
+        depth = stack_depth(callee, graph, frames, memo, path, problems)
+        if is_call:
+            depth += CALL_SIZE
+        deepest = max(deepest, depth)
+    path.discard(func)
+
+    memo[func] = frame + deepest
+    return memo[func]
+
+
+def check(label, used, budget):
+    status = 'ok' if used <= budget else 'OVER BUDGET'
+    print("{:<24}{:>8} / {:<8}{}".format(label, used, budget, status))
+    return used <= budget
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='Bootloader footprint report')
+    parser.add_argument('--elf', default='bootloader_dbg.elf')
+    parser.add_argument('--map', default='bootloader.map')
+    parser.add_argument('--su-dir', default='.',
+                        help='Directory holding the -fstack-usage output.')
+    parser.add_argument('--nm', default='avr-nm')
+    parser.add_argument('--objdump', default='avr-objdump')
+    parser.add_argument('--size', default='avr-size')
+    parser.add_argument('--root', default='main',
+                        help='Function the stack depth is measured from.')
+    parser.add_argument('--flash-budget', type=int, default=8192)
+    parser.add_argument('--sram-budget', type=int, default=16384)
+    parser.add_argument('--stack-budget', type=int, default=1024)
+    args = parser.parse_args()
+
+    funcs, data = read_symbols(args.nm, args.elf)
+    sections = read_sections(args.size, args.elf)
+    objects = read_objects(args.map)
+    frames = read_stack_usage(args.su_dir)
+    graph, indirect = read_call_graph(args.objdump, args.elf)
+
+    memo = {}
+    problems = set()
+    for func in funcs:
+        stack_depth(func, graph, frames, memo, set(), problems)
+    for func in indirect:
+        problems.add("{} makes indirect calls (not followed)".format(func))
+    for func in graph:
+        if func in funcs and func not in frames:
+            problems.add("{} has no stack usage information".format(func))
+
+    print("{:<32}{:>8}{:>8}{:>8}".format('function', 'flash', 'frame', 'depth'))
+    for name in sorted(funcs, key=lambda n: -funcs[n]):
+        print("{:<32}{:>8}{:>8}{:>8}".format(name, funcs[name],
+                                          frames.get(name, ('-',))[0],
+                                          memo.get(name, '-')))
+
+    print()
+    print("{:<32}{:>8}".format('object', 'flash'))
+    for name in sorted(objects, key=lambda n: -objects[n]):
+        print("{:<32}{:>8}".format(name, objects[name]))
+
+    print()
+    print("{:<32}{:>8}".format('variable', 'sram'))
+    for name in sorted(data, key=lambda n: -data[n]):
+        print("{:<32}{:>8}".format(name, data[name]))
+
+    if problems:
+        print()
+        for problem in sorted(problems):
+            print("warning: " + problem)
+
+    # .data is stored in flash and copied to SRAM at startup.
+    flash = sections.get('.text', 0) + sections.get('.data', 0)
+    static = sections.get('.data', 0) + sections.get('.bss', 0)
+    stack = memo.get(args.root, 0)
+
+    print()
+    ok = check('flash (code + data)', flash, args.flash_budget)
+    ok = check('stack from ' + args.root, stack, args.stack_budget) and ok
+    ok = check('sram (static + stack)', static + stack, args.sram_budget) and ok
+
+    if not ok:
+        sys.exit(1)
@@ -8,18 +8,32 @@
 //
 // CBC enables AES128 encryption in CBC-mode of operation and handles 0-padding.
 // ECB enables the basic ECB 16-byte block algorithm. Both can be enabled simultaneously.
+// CTR generates counter mode keystream one block at a time with the forward cipher.
+// MAC computes a CBC-MAC under a second key; CBC decryption can feed it as it goes.
 
 // The #ifndef-guard allows it to be configured before #include'ing or at compile time.
+//
+// Keys are not expanded on the device: AES128_init loads round keys expanded by
+// bl_build from EEPROM, and every other function uses them.
+
+
+
+
+void AES128_init(const uint8_t* round_keys, const uint8_t* mac_round_keys);
+
+
+void AES128_ECB_encrypt(const uint8_t* input, uint8_t *output);
+void AES128_ECB_decrypt(const uint8_t* input, uint8_t *output);
 
 
+void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* iv);
+void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* iv, uint8_t* mac);
 
 
-void AES128_ECB_encrypt(const uint8_t* input, const uint8_t* key, uint8_t *output);
-void AES128_ECB_decrypt(const uint8_t* input, const uint8_t* key, uint8_t *output);
+void AES128_CTR_keystream(uint8_t* output, uint8_t* counter);
 
 
-void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv);
-void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv);
+void AES128_MAC_update(uint8_t* mac, const uint8_t* block);
 
 
 #endif //_AES_H_
@@ -0,0 +1,66 @@
+/*
+ * Hardware abstraction layer.
+ *
+ * bootloader.c, aes.c and spi.c reach the hardware only through the names
+ * below (plus the UART driver in uart.h, and spi.c's interrupt-driven sleep
+ * on the AVR), so that they build either for the AVR (hal_avr.h, the
+ * default) or, with HAL_LINUX=1, as a Linux program (hal_linux.h and
+ * hal_linux.c) for benchmarking and testing on the host.
+ *
+ * Flash, SPM_PAGESIZE pages, byte addresses:
+ *   hal_spm_busy()             true while a page erase or write runs
+ *   hal_page_erase(addr)       start erasing a page; the caller checks
+ *                              hal_spm_busy() and hal_eeprom_ready() first
+ *   hal_page_erase_safe(addr)  erase a page once the last operation is done
+ *   hal_page_fill_safe(a, w)   put a little-endian word in the page buffer
+ *   hal_page_write_safe(addr)  program the page buffer into a page
+ *   hal_rww_enable_safe()      make the application section readable again
+ *   hal_flash_read_byte(addr)  read a byte anywhere in flash
+ *
+ * EEPROM, variables declared EEMEM:
+ *   hal_eeprom_ready(), hal_eeprom_read_byte/word/dword/block(),
+ *   hal_eeprom_update_word/dword()
+ *
+ * Watchdog and reset:
+ *   hal_wdt_enable(WDTO_...), hal_wdt_reset(), hal_wdt_disable()
+ *   hal_wait_reset()           wait for the watchdog to reset the part
+ *
+ * Timer, free running at F_CPU / 1024:
+ *   hal_timer_now()            the current count, wrapping at 16 bits
+ *
+ * SPI slave and READY line, for spi.c:
+ *   hal_spi_init()             slave mode 0, MISO and READY driven
+ *   hal_spi_load(byte)         the byte the next transfer sends the master
+ *   hal_spi_clocked()          true once the master has clocked a transfer
+ *   hal_spi_take()             the byte that transfer brought in; clears
+ *                              hal_spi_clocked()
+ *   hal_ready_toggle()         toggle READY
+ *
+ * Board and start-up:
+ *   hal_init()                 first thing main() does
+ *   hal_jumper(HAL_JUMPER_UPDATE or HAL_JUMPER_READBACK)
+ *                              true if that jumper is fitted
+ *   hal_vectors_boot()         take the interrupt vectors for the bootloader
+ *   hal_start_app()            stop Timer1, hand the vectors back and jump
+ *                              to address 0
+ *   hal_heap_start             start of the SRAM free for frame buffers
+ *   hal_sram_free(p)           bytes free between p and the stack
+ *
+ * _crc_ccitt_update() comes from <util/crc16.h> or its equivalent.
+ */
+
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#ifndef HAL_LINUX
+#define HAL_LINUX 0
+#endif
+
+#if HAL_LINUX
+#include "hal_linux.h"
+#else
+#include "hal_avr.h"
+#endif
+
+#endif /* HAL_H_ */
@@ -0,0 +1,111 @@
+/*
+ * AVR backend of the hardware abstraction layer: every name maps straight
+ * onto avr-libc or the registers, so it costs nothing. See hal.h.
+ */
+
+
+#ifndef HAL_AVR_H_
+#define HAL_AVR_H_
+
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+#include <avr/wdt.h>
+#include <util/crc16.h>
+
+#define hal_spm_busy()            boot_spm_busy()
+#define hal_page_erase(addr)      boot_page_erase(addr)
+#define hal_page_erase_safe(addr) boot_page_erase_safe(addr)
+#define hal_page_fill_safe(a, w)  boot_page_fill_safe(a, w)
+#define hal_page_write_safe(addr) boot_page_write_safe(addr)
+#define hal_rww_enable_safe()     boot_rww_enable_safe()
+#define hal_flash_read_byte(addr) pgm_read_byte_far(addr)
+
+#define hal_eeprom_ready()            eeprom_is_ready()
+#define hal_eeprom_read_byte(p)       eeprom_read_byte(p)
+#define hal_eeprom_read_word(p)       eeprom_read_word(p)
+#define hal_eeprom_read_dword(p)      eeprom_read_dword(p)
+#define hal_eeprom_read_block(d, s, n) eeprom_read_block(d, s, n)
+#define hal_eeprom_update_word(p, v)  eeprom_update_word(p, v)
+#define hal_eeprom_update_dword(p, v) eeprom_update_dword(p, v)
+
+#define hal_wdt_enable(t) wdt_enable(t)
+#define hal_wdt_reset()   wdt_reset()
+#define hal_wdt_disable() wdt_disable()
+#define hal_wait_reset()  while(1) __asm__ __volatile__("")
+
+#define hal_timer_now() TCNT1
+
+// Jumpers pull Port B pins to ground (PB2 and PB3 on the protostack board).
+#define HAL_JUMPER_UPDATE   (1 << PB2)
+#define HAL_JUMPER_READBACK (1 << PB3)
+
+/* Make the jumper pins inputs with pullups. */
+#define hal_init()                                           \
+    do {                                                     \
+        DDRB &= ~(HAL_JUMPER_UPDATE | HAL_JUMPER_READBACK);  \
+        PORTB |= HAL_JUMPER_UPDATE | HAL_JUMPER_READBACK;    \
+    } while (0)
+#define hal_jumper(pin) (!(PINB & (pin)))
+
+// The SPI slave's MISO (PB6), and the READY line (PB0) toggled each time the
+// bootloader can take part in one more byte transfer. The host bridge waits
+// for it to change before every byte.
+#define HAL_SPI_MISO  (1 << PB6)
+#define HAL_SPI_READY (1 << PB0)
+
+/* Slave mode 0, MISO and READY driven. */
+#define hal_spi_init()                           \
+    do {                                         \
+        DDRB |= HAL_SPI_MISO | HAL_SPI_READY;    \
+        SPCR = (1 << SPE);                       \
+    } while (0)
+#define hal_spi_load(byte)  (SPDR = (byte))
+#define hal_spi_clocked()   ((SPSR & (1 << SPIF)) != 0)
+#define hal_spi_take()      SPDR
+#define hal_ready_toggle()  (PORTB ^= HAL_SPI_READY)
+
+/* Point the interrupt vectors at the bootloader section (sel) or the
+ * application. IVSEL only changes within four cycles of setting IVCE, so both
+ * values are worked out first; the rest of MCUCR is written back as read.
+ */
+#define hal_vectors_select(sel)                                           \
+    do {                                                                  \
+        uint8_t mcucr = MCUCR & ~(1 << IVCE);                             \
+        uint8_t enable = mcucr | (1 << IVCE);                             \
+        uint8_t select = (sel) ? (mcucr | (1 << IVSEL))                   \
+                               : (mcucr & ~(1 << IVSEL));                 \
+        MCUCR = enable;                                                   \
+        MCUCR = select;                                                   \
+    } while (0)
+
+#define hal_vectors_boot() hal_vectors_select(1)
+
+/* Stop Timer1, which the receive deadlines run, and put back its reset
+ * values so the application finds it as after a reset: no clock, no compare
+ * interrupt and no flag left pending to fire when it enables one.
+ */
+#define hal_timer_stop()                                                  \
+    do {                                                                  \
+        TCCR1B = 0;                                                       \
+        TIMSK1 = 0;                                                       \
+        TCNT1 = 0;                                                        \
+        OCR1A = 0;                                                        \
+        TIFR1 = (1 << ICF1) | (1 << OCF1B) | (1 << OCF1A) | (1 << TOV1);  \
+    } while (0)
+
+/* Make the leap of faith. */
+#define hal_start_app()          \
+    do {                         \
+        hal_timer_stop();        \
+        hal_vectors_select(0);   \
+        asm ("jmp 0000");        \
+    } while (0)
+
+// The SRAM between the static data and the stack.
+extern uint8_t __heap_start;
+#define hal_heap_start (&__heap_start)
+#define hal_sram_free(p) ((uint16_t)(SP - (uint16_t)(p)))
+
+#endif /* HAL_AVR_H_ */
@@ -0,0 +1,86 @@
+/*
+ * Linux backend of the hardware abstraction layer, for running the
+ * bootloader natively (make native). Flash and EEPROM are in memory, the
+ * UARTs and the SPI bus are file descriptors and the watchdog is a timer
+ * signal; see hal_linux.c for how to drive it.
+ */
+
+
+#ifndef HAL_LINUX_H_
+#define HAL_LINUX_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define SPM_PAGESIZE 256
+#define HAL_FLASH_SIZE 0x20000UL
+
+// EEMEM variables are kept together so they can be saved and loaded as the
+// EEPROM image.
+#define EEMEM __attribute__((section("eeprom")))
+
+// Watchdog periods, in milliseconds.
+#define WDTO_15MS  15
+#define WDTO_500MS 500
+
+#define HAL_JUMPER_UPDATE   0x01
+#define HAL_JUMPER_READBACK 0x02
+
+extern uint8_t hal_flash[HAL_FLASH_SIZE];
+
+#define hal_flash_read_byte(addr) (hal_flash[(addr) % HAL_FLASH_SIZE])
+
+bool hal_spm_busy(void);
+void hal_page_erase(uint32_t addr);
+void hal_page_erase_safe(uint32_t addr);
+void hal_page_fill_safe(uint32_t addr, uint16_t word);
+void hal_page_write_safe(uint32_t addr);
+void hal_rww_enable_safe(void);
+
+// EEPROM variables are ordinary memory.
+#define hal_eeprom_ready()             true
+#define hal_eeprom_read_byte(p)        (*(const uint8_t *)(p))
+#define hal_eeprom_read_word(p)        (*(const uint16_t *)(p))
+#define hal_eeprom_read_dword(p)       (*(const uint32_t *)(p))
+#define hal_eeprom_read_block(d, s, n) memcpy(d, s, n)
+#define hal_eeprom_update_word(p, v)   (*(p) = (v))
+#define hal_eeprom_update_dword(p, v)  (*(p) = (v))
+
+void hal_wdt_enable(unsigned int ms);
+void hal_wdt_reset(void);
+void hal_wdt_disable(void);
+void hal_wait_reset(void) __attribute__((noreturn));
+
+uint16_t hal_timer_now(void);
+
+void hal_spi_init(void);
+void hal_spi_load(uint8_t byte);
+bool hal_spi_clocked(void);
+uint8_t hal_spi_take(void);
+void hal_ready_toggle(void);
+// spi.c's stand-in for sleeping: wait up to ms for the master to clock.
+void hal_spi_wait(unsigned int ms);
+
+void hal_init(void);
+bool hal_jumper(uint8_t pin);
+#define hal_vectors_boot() do { } while (0)
+void hal_start_app(void) __attribute__((noreturn));
+
+// Stands in for the SRAM left between the static data and the stack.
+#define HAL_SRAM_FREE 12288
+extern uint8_t hal_sram[HAL_SRAM_FREE];
+#define hal_heap_start hal_sram
+#define hal_sram_free(p) ((uint16_t)(hal_sram + HAL_SRAM_FREE - (p)))
+
+/* The C equivalent given in avr-libc's <util/crc16.h>. */
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+    data ^= (uint8_t)crc;
+    data ^= data << 4;
+
+    return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4)
+            ^ ((uint16_t)data << 3));
+}
+
+#endif /* HAL_LINUX_H_ */
@@ -0,0 +1,24 @@
+/*
+ * SPI slave configuration headers.
+ */
+
+
+#ifndef SPI_H_
+#define SPI_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+void SPI_init(void);
+
+void SPI_putchar(unsigned char data);
+
+bool SPI_data_available(void);
+unsigned char SPI_getchar(void);
+
+void SPI_sleep(void);
+
+void SPI_flush(void);
+
+void SPI_resync(void);
+#endif /* SPI_H_ */
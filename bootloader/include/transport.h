@@ -0,0 +1,43 @@
+/*
+ * Transport the bootloader talks to the host over, chosen at build time with
+ * TRANSPORT in the Makefile: UART1 (the default) or the SPI slave. Each name
+ * below maps straight onto the backend's driver, so the choice costs nothing
+ * at run time. Both backends share the Timer1 receive deadlines in uart.c.
+ */
+
+
+#ifndef TRANSPORT_H_
+#define TRANSPORT_H_
+
+#include "uart.h"
+#include "spi.h"
+
+#define TRANSPORT_UART 0
+#define TRANSPORT_SPI  1
+
+#ifndef TRANSPORT
+#define TRANSPORT TRANSPORT_UART
+#endif
+
+#if TRANSPORT == TRANSPORT_SPI
+#define transport_init           SPI_init
+#define transport_putchar        SPI_putchar
+#define transport_data_available SPI_data_available
+#define transport_getchar        SPI_getchar
+#define transport_sleep          SPI_sleep
+#define transport_resync         SPI_resync
+#elif TRANSPORT == TRANSPORT_UART
+#define transport_init           UART1_init
+#define transport_putchar        UART1_putchar
+#define transport_data_available UART1_data_available
+#define transport_getchar        UART1_getchar
+#define transport_sleep          UART1_sleep
+#define transport_resync         UART1_resync
+#else
+#error "TRANSPORT must be UART or SPI"
+#endif
+
+#define transport_timeout_begin   UART1_timeout_begin
+#define transport_timeout_expired UART1_timeout_expired
+
+#endif /* TRANSPORT_H_ */
@@ -7,6 +7,23 @@
 #define UART_H_
 
 #include <stdbool.h>
+#include <stdint.h>
+
+// Receive deadlines for UART1, in milliseconds. A frame must arrive within
+// UART1_FRAME_TIMEOUT_MS of UART1_timeout_begin(), with no gap between bytes
+// longer than UART1_BYTE_TIMEOUT_MS.
+#define UART1_FRAME_TIMEOUT_MS 400
+#define UART1_BYTE_TIMEOUT_MS  20
+
+// Longest UART1_sleep() lasts before waking to let callers check deadlines.
+#define UART1_WAKE_MS 5
+
+// Timer1 runs from F_CPU / 1024.
+#define UART_TIMER_TICKS(ms) ((uint16_t)(((uint32_t)(ms) * (F_CPU / 1024UL)) / 1000UL))
+
+void UART_timer_init(void);
+void UART_timer_byte(void);
+bool UART_timer_byte_expired(void);
 
 void UART1_init(void);
 
@@ -15,10 +32,16 @@ void UART1_putchar(unsigned char data);
 bool UART1_data_available(void);
 unsigned char UART1_getchar(void);
 
+void UART1_sleep(void);
+
 void UART1_flush(void);
 
 void UART1_putstring(char* str);
 
+void UART1_timeout_begin(void);
+bool UART1_timeout_expired(void);
+void UART1_resync(void);
+
 
 void UART0_init(void);
 
@@ -29,5 +52,7 @@ unsigned char UART0_getchar(void);
 
 void UART0_flush(void);
 
+void UART0_resync(void);
+
 void UART0_putstring(char* str);
 #endif /* UART_H_ */
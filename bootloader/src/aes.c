@@ -1,7 +1,8 @@
 /*
 From Tiny AES 128: https://github.com/kokke/tiny-AES128-C
 
-This is an implementation of the AES128 algorithm, specifically ECB and CBC mode.
+This is an implementation of the AES128 algorithm, specifically ECB, CBC and CTR mode,
+plus a CBC-MAC that runs alongside CBC decryption under its own key.
 The implementation is verified against the test vectors in:
   National Institute of Standards and Technology Special Publication 800-38A 2001 ED
 ECB-AES128
@@ -29,12 +30,7 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 #include <stdint.h>
 #include <string.h> // CBC mode, for memset
 #include "aes.h"
-#include "uart.h"
-
-#include <avr/pgmspace.h>
-#include <avr/boot.h>
-#include <avr/interrupt.h>
-#include <avr/wdt.h>
+#include "hal.h"
 
 /*****************************************************************************/
 /* Defines:                                                                  */
@@ -63,11 +59,18 @@ NOTE:   String length must be evenly divisible by 16byte (str_len % 16 == 0)
 typedef uint8_t state_t[4][4];
 static state_t* state;
 
-// The array that stores the round keys.
+// The array that stores the round keys. They are expanded at build time by
+// bl_build and loaded by AES128_init. InvCipher applies the same round keys
+// in reverse order, so no separate decryption schedule is needed.
 static uint8_t RoundKey[176];
 
-// The Key input to the AES Program
-static const uint8_t* Key;
+// The round keys of the MAC key, kept apart so that MAC and cipher blocks can
+// be interleaved.
+static uint8_t MacRoundKey[176];
+
+// The round keys AddRoundKey uses. Set by AES128_init(), since initialized
+// data is never copied to SRAM.
+static uint8_t* Schedule;
 
 // Initial Vector used only for CBC mode
 static uint8_t* Iv;
@@ -116,28 +119,6 @@ static const uint8_t Rsbox[256] EEMEM =
 
 uint8_t rsbox[256];
 
-// The round constant word array, Rcon[i], contains the values given by 
-// x to th e power (i-1) being powers of x (x is denoted as {02}) in the field GF(2^8)
-// Note that i starts at 1, not 0).
-static const uint8_t rcon[255] EEMEM = {
-  0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 
-  0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 
-  0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 
-  0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 
-  0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 
-  0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 
-  0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 
-  0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 
-  0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 
-  0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 
-  0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 0xc6, 0x97, 0x35, 
-  0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 0x61, 0xc2, 0x9f, 
-  0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb, 0x8d, 0x01, 0x02, 0x04, 
-  0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36, 0x6c, 0xd8, 0xab, 0x4d, 0x9a, 0x2f, 0x5e, 0xbc, 0x63, 
-  0xc6, 0x97, 0x35, 0x6a, 0xd4, 0xb3, 0x7d, 0xfa, 0xef, 0xc5, 0x91, 0x39, 0x72, 0xe4, 0xd3, 0xbd, 
-  0x61, 0xc2, 0x9f, 0x25, 0x4a, 0x94, 0x33, 0x66, 0xcc, 0x83, 0x1d, 0x3a, 0x74, 0xe8, 0xcb  };
-
-uint8_t Rcon[255];
 
 /*****************************************************************************/
 /* Private functions:                                                        */
@@ -152,72 +133,6 @@ static uint8_t getSBoxInvert(uint8_t num)
   return rsbox[num];
 }
 
-// This function produces Nb(Nr+1) round keys. The round keys are used in each round to decrypt the states. 
-static void KeyExpansion(void)
-{
-  uint32_t i, j, k;
-  uint8_t tempa[4]; // Used for the column/row operations
-  
-  // The first round key is the key itself.
-  for(i = 0; i < Nk; ++i)
-  {
-    RoundKey[(i * 4) + 0] = Key[(i * 4) + 0];
-    RoundKey[(i * 4) + 1] = Key[(i * 4) + 1];
-    RoundKey[(i * 4) + 2] = Key[(i * 4) + 2];
-    RoundKey[(i * 4) + 3] = Key[(i * 4) + 3];
-  }
-
-  // All other round keys are found from the previous round keys.
-  for(; (i < (Nb * (Nr + 1))); ++i)
-  {
-    for(j = 0; j < 4; ++j)
-    {
-      tempa[j]=RoundKey[(i-1) * 4 + j];
-    }
-    if (i % Nk == 0)
-    {
-      // This function rotates the 4 bytes in a word to the left once.
-      // [a0,a1,a2,a3] becomes [a1,a2,a3,a0]
-
-      // Function RotWord()
-      {
-        k = tempa[0];
-        tempa[0] = tempa[1];
-        tempa[1] = tempa[2];
-        tempa[2] = tempa[3];
-        tempa[3] = k;
-      }
-
-      // SubWord() is a function that takes a four-byte input word and 
-      // applies the S-box to each of the four bytes to produce an output word.
-
-      // Function Subword()
-      {
-        tempa[0] = getSBoxValue(tempa[0]);
-        tempa[1] = getSBoxValue(tempa[1]);
-        tempa[2] = getSBoxValue(tempa[2]);
-        tempa[3] = getSBoxValue(tempa[3]);
-      }
-
-      tempa[0] =  tempa[0] ^ Rcon[i/Nk];
-    }
-    else if (Nk > 6 && i % Nk == 4)
-    {
-      // Function Subword()
-      {
-        tempa[0] = getSBoxValue(tempa[0]);
-        tempa[1] = getSBoxValue(tempa[1]);
-        tempa[2] = getSBoxValue(tempa[2]);
-        tempa[3] = getSBoxValue(tempa[3]);
-      }
-    }
-    RoundKey[i * 4 + 0] = RoundKey[(i - Nk) * 4 + 0] ^ tempa[0];
-    RoundKey[i * 4 + 1] = RoundKey[(i - Nk) * 4 + 1] ^ tempa[1];
-    RoundKey[i * 4 + 2] = RoundKey[(i - Nk) * 4 + 2] ^ tempa[2];
-    RoundKey[i * 4 + 3] = RoundKey[(i - Nk) * 4 + 3] ^ tempa[3];
-  }
-}
-
 // This function adds the round key to state.
 // The round key is added to the state by an XOR function.
 static void AddRoundKey(uint8_t round)
@@ -227,7 +142,7 @@ static void AddRoundKey(uint8_t round)
   {
     for(j = 0; j < 4; ++j)
     {
-      (*state)[i][j] ^= RoundKey[round * Nb * 4 + i * Nb + j];
+      (*state)[i][j] ^= Schedule[round * Nb * 4 + i * Nb + j];
     }
   }
 }
@@ -434,6 +349,14 @@ static void InvCipher(void)
   AddRoundKey(0);
 }
 
+static void LoadTables(void)
+{
+  for (int i = 0; i < 256; i++) {
+    sbox[i] = hal_eeprom_read_byte(&(Sbox[i]));
+    rsbox[i] = hal_eeprom_read_byte(&(Rsbox[i]));
+  }
+}
+
 static void BlockCopy(uint8_t* output, const uint8_t* input)
 {
   uint8_t i;
@@ -451,45 +374,34 @@ static void BlockCopy(uint8_t* output, const uint8_t* input)
 /*****************************************************************************/
 
 
-void AES128_ECB_encrypt(const uint8_t* input, const uint8_t* key, uint8_t* output)
+// Loads the lookup tables and the round keys of the cipher and MAC keys from
+// EEPROM. Must be called before any other function; the other functions never
+// touch EEPROM.
+void AES128_init(const uint8_t* round_keys, const uint8_t* mac_round_keys)
+{
+  LoadTables();
+
+  hal_eeprom_read_block(RoundKey, round_keys, sizeof(RoundKey));
+  hal_eeprom_read_block(MacRoundKey, mac_round_keys, sizeof(MacRoundKey));
+  Schedule = RoundKey;
+}
+
+void AES128_ECB_encrypt(const uint8_t* input, uint8_t* output)
 {
   // Copy input to output, and work in-memory on output
   BlockCopy(output, input);
   state = (state_t*)output;
 
-  for (int i = 0; i < 256; i++) {
-    sbox[i] = eeprom_read_byte(&(Sbox[i]));
-    rsbox[i] = eeprom_read_byte(&(Rsbox[i]));
-    if (i != 255) {
-        Rcon[i] = eeprom_read_byte(&(rcon[i]));
-    }
-  }
-
-  Key = key;
-  KeyExpansion();
-
   // The next function call encrypts the PlainText with the Key using AES algorithm.
   Cipher();
 }
 
-void AES128_ECB_decrypt(const uint8_t* input, const uint8_t* key, uint8_t *output)
+void AES128_ECB_decrypt(const uint8_t* input, uint8_t *output)
 {
   // Copy input to output, and work in-memory on output
   BlockCopy(output, input);
   state = (state_t*)output;
 
-  for (int i = 0; i < 256; i++) {
-    sbox[i] = eeprom_read_byte(&(Sbox[i]));
-    rsbox[i] = eeprom_read_byte(&(Rsbox[i]));
-    if (i != 255) {
-        Rcon[i] = eeprom_read_byte(&(rcon[i]));
-    }
-  }
-
-  // The KeyExpansion routine must be called before encryption.
-  Key = key;
-  KeyExpansion();
-
   InvCipher();
 }
 
@@ -504,29 +416,14 @@ static void XorWithIv(uint8_t* buf)
   }
 }
 
-void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* iv)
 {
   uintptr_t i;
   uint8_t remainders = length % KEYLEN; /* Remaining bytes in the last non-full block */
 
-  for (int i = 0; i < 256; i++) {
-    sbox[i] = eeprom_read_byte(&(Sbox[i]));
-    rsbox[i] = eeprom_read_byte(&(Rsbox[i]));
-    if (i != 255) {
-        Rcon[i] = eeprom_read_byte(&(rcon[i]));
-    }
-  }
-
   BlockCopy(output, input);
   state = (state_t*)output;
 
-  // Skip the key expansion if key is passed as 0
-  if(0 != key)
-  {
-    Key = key;
-    KeyExpansion();
-  }
-
   if(iv != 0)
   {
     Iv = (uint8_t*)iv;
@@ -552,29 +449,16 @@ void AES128_CBC_encrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length,
   }
 }
 
-void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* key, const uint8_t* iv)
+// If mac is not 0, every whole ciphertext block is also added to the CBC-MAC
+// in mac (see AES128_MAC_update) as it is decrypted.
+void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length, const uint8_t* iv, uint8_t* mac)
 {
   uintptr_t i;
   uint8_t remainders = length % KEYLEN; /* Remaining bytes in the last non-full block */
-  
-  for (int i = 0; i < 256; i++) {
-    sbox[i] = eeprom_read_byte(&(Sbox[i]));
-    rsbox[i] = eeprom_read_byte(&(Rsbox[i]));
-    if (i != 255) {
-        Rcon[i] = eeprom_read_byte(&(rcon[i]));
-    }
-  }
 
   BlockCopy(output, input);
   state = (state_t*)output;
 
-  // Skip the key expansion if key is passed as 0
-  if(0 != key)
-  {
-    Key = key;
-    KeyExpansion();
-  }
-
   // If iv is passed as 0, we continue to encrypt without re-setting the Iv
   if(iv != 0)
   {
@@ -583,6 +467,11 @@ void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length,
 
   for(i = 0; i < length; i += KEYLEN)
   {
+    if(mac != 0)
+    {
+      AES128_MAC_update(mac, input);
+    }
+
     BlockCopy(output, input);
     state = (state_t*)output;
     InvCipher();
@@ -600,3 +489,42 @@ void AES128_CBC_decrypt_buffer(uint8_t* output, uint8_t* input, uint32_t length,
     InvCipher();
   }
 }
+
+
+// Writes the keystream block for counter to output and increments counter
+// (as a 128-bit big-endian number). Only the forward cipher is needed, so the
+// keystream can be generated before the ciphertext it applies to arrives.
+void AES128_CTR_keystream(uint8_t* output, uint8_t* counter)
+{
+  int8_t i;
+
+  BlockCopy(output, counter);
+  state = (state_t*)output;
+  Cipher();
+
+  for(i = KEYLEN - 1; i >= 0; --i)
+  {
+    if(++counter[i] != 0)
+    {
+      break;
+    }
+  }
+}
+
+
+// Adds one block to the CBC-MAC in mac: mac = E(mac ^ block) under the MAC
+// key. Start from a zeroed mac; after the last block it holds the tag.
+void AES128_MAC_update(uint8_t* mac, const uint8_t* block)
+{
+  uint8_t i;
+
+  for(i = 0; i < KEYLEN; ++i)
+  {
+    mac[i] ^= block[i];
+  }
+
+  state = (state_t*)mac;
+  Schedule = MacRoundKey;
+  Cipher();
+  Schedule = RoundKey;
+}
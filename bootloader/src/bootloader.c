@@ -9,88 +9,398 @@
  * Port B Pin 3 (PB3 on the protostack board) is pulled to ground, then the 
  * bootloader will enter flash memory readback mode. 
  * 
+ * If BOTH of these pins are pulled to ground, the bootloader will enter a
+ * session and run commands from UART1 until told to boot. Each command is a
+ * single byte which the bootloader echoes back before running it:
+ * 'S' -- status: replies OK followed by the 2-byte version and 4-byte size.
+ * 'R' -- readback: followed by a readback request, as in readback mode.
+ * 'U' -- update: followed by a firmware package, as in update mode.
+ * 'B' -- boot: execute the application from flash.
+ * 'M' -- broadcast update: not echoed; see below.
+ * 'L' id -- frame limit, before a broadcast update: not echoed; only the
+ *           device with bus ID id answers, with OK and the number of pages
+ *           it can take per frame.
+ * Unknown commands are answered with ERROR.
+ *
  * If NEITHER of these pins are pulled to ground, then the bootloader will 
  * execute the application from flash.
  *
  * If data is sent on UART for an update, the bootloader will expect that data 
- * to be sent in frames. A frame consists of two sections:
+ * to be sent in frames. A frame consists of four sections:
  * 1. Two bytes for the length of the data section
- * 2. A data section of length defined in the length section
+ * 2. A one byte sequence number
+ * 3. A data section of length defined in the length section
+ * 4. A two byte CRC (CRC-16/CCITT, initial value 0xFFFF, as computed by
+ *    _crc_ccitt_update()) of all the bytes before it, most significant byte
+ *    first
+ *
+ * [ 0x02 ]  [ 0x01 ]  [ variable ]  [ 0x02 ]
+ * ------------------------------------------
+ * |  Length |  Seq  |  Data...   |   CRC  |
+ *
+ * The CRC is checked before anything in the frame is used. A frame with a
+ * bad CRC (or an impossible length) is discarded and answered with NAK
+ * followed by the sequence number of the frame the bootloader expects, so
+ * the host sends just that frame again. The first frame of an update or
+ * readback request is number 0, and each frame accepted with OK advances the
+ * number by one (wrapping at 256). A frame repeating the last one accepted,
+ * because its OK was lost, is acknowledged again but not used twice.
+ *
+ * The first frame of an update is the encrypted header. The bootloader accepts
+ * it with OK, OK, OK and then sends one byte giving the largest number of pages
+ * it will take in a single frame, sized from the SRAM left free above the
+ * static data. Every following frame carries one or more pages, each as the
+ * 2-byte number of the flash page it belongs at (its address / SPM_PAGESIZE),
+ * its 16-byte IV, the 256 encrypted bytes of the page and a 16-byte tag:
+ *
+ * [ 0x02 ]  [ 0x02 ] [ 0x10 ] [ 0x100 ] [ 0x10 ]      [ 0x02 ] ... [ 0x10 ]
+ * ---------------------------------------------------------------------------
+ * |  Length | Number |  IV   | Page...|  Tag  | ... | Number | ... |  Tag  |
+ *
+ * Only populated pages need to be sent, in any order, but each page only once.
+ * The header holds the 4-byte nonce, the 2-byte version, the 4-byte size and
+ * a flags byte. The size is the end address of the image (where the release
+ * message is stored), anywhere up to the bootloader section, and every page
+ * below it is erased, so pages that are not sent read back as erased flash.
+ *
+ * A metadata-only update (HDR_FLAG_METADATA) changes just the version and the
+ * release message. Its size must be the installed image's size, and it only
+ * carries the pages holding the message, with erased bytes in place of the
+ * image. Nothing is erased up front; each of those pages is merged with the
+ * image bytes already in flash below the size, then erased and reprogrammed.
+ * A page below the size rejects the update.
+ *
+ * Frames are stored in an intermediate buffer until the whole frame has been
+ * sent, at which point its pages are decrypted and written to flash in order
+ * and the frame is acknowledged with OK. See program_flash() for information
+ * on the process of programming the flash memory. Pages are not committed as
+ * each one completes within the frame: a frame that then failed its CRC could
+ * not be sent again over pages already written, and committing keeps the CPU
+ * busy for milliseconds (CBC decryption, waiting out the erase and write)
+ * while a byte arrives every millisecond at 9600 baud, with only the USART's
+ * two bytes to hold them. Waiting for the frame costs little, as programming
+ * a page takes about 4.5 ms against about 300 ms to receive it. Measured with
+ * frame_bench against the native build over a pseudo-terminal, a 116 KB image
+ * took 0.12-0.14 s at 1 page per frame and 0.08-0.09 s at 16; transport_sim
+ * estimates 143 s and 142 s at 9600 baud, where the link dominates.
+ *
+ * Once the header frame has been accepted, the pages the image will occupy
+ * are erased in the background while the following frames are received. A
+ * frame with a length of zero ends the update; in update mode the bootloader
+ * acknowledges it and boots the new image straight away.
+ *
+ * Pages are encrypted with CBC, or with CTR if the header's flags byte has
+ * HDR_FLAG_CTR set. In CTR mode the IV is the page's first counter block, and
+ * the keystream for a page is generated while waiting on UART1 for its bytes,
+ * so each block is decrypted with XORs as it arrives.
+ *
+ * Every encrypted frame is authenticated: the header and readback request end
+ * in a 16-byte tag after the ciphertext, and so does each page. The tag is the
+ * CBC-MAC, under a key derived from the AES key, of
+ *
+ * [ 0x01 ]  [ 0x02 ]  [ 0x02 ]  [ 0x02 ]  [ 0x09 ]  [ 0x10 ]  [ variable ]
+ * ----------------------------------------------------------------------
+ * |  Label | Length |   ID   |  Extra |  Zeros  |   IV   | Ciphertext |
  *
- * [ 0x02 ]  [ variable ]
- * ----------------------
- * |  Length |  Data... |
+ * where the label is 'H' for an update header, 'Q' for a readback request and
+ * 'P' for a page, whose ID and Extra are its page number and the version in
+ * the header. The MAC is computed in the same pass as decryption, one extra
+ * block operation per block, and a page whose tag does not match is answered
+ * with ERROR before it reaches program_flash().
  *
- * Frames are stored in an intermediate buffer until a complete page has been
- * sent, at which point the page is written to flash. See program_flash() for
- * information on the process of programming the flash memory. Note that if no
- * frame is received after 2 seconds, the bootloader will time out and reset.
+ * A readback request with RB_FLAG_DIGEST set is answered with a 16-byte
+ * digest per page instead of the encrypted page. The digest is the CBC-MAC,
+ * under a key derived from the AES key, of a block holding 'D', the page's
+ * address and the request's seed, followed by the page. The host compares the
+ * digests with its own image and reads back only the pages that differ.
+ *
+ * Once the first byte of a frame has arrived, the rest of the frame must follow
+ * within UART1_FRAME_TIMEOUT_MS, with no gap longer than UART1_BYTE_TIMEOUT_MS
+ * (see uart.h). If either deadline passes, the bootloader discards input until
+ * the line is quiet, answers NAK (and the expected sequence number) and waits
+ * for the frame to be sent again. For frames carrying several pages, the
+ * deadlines restart at every page.
+ *
+ * A broadcast update ('M' in a session) lets one host stream update every
+ * board on a shared bus, after asking each for its frame limit ('L' above),
+ * with frames no larger than the smallest. It is an update as above except
+ * that the devices never answer, so the host paces the frames instead of
+ * waiting for OK, and a page that times out or fails its CRC or tag is skipped
+ * rather than NAKed or rejected. Sequence numbers are not checked while the
+ * frames are broadcast. Each device keeps a bitmap of the pages it has
+ * written. A device that misses the header skips every frame. After the
+ * zero-length frame, the devices stay silent and obey commands addressed by
+ * bus ID (bus_id in EEPROM, BUS_ID in the Makefile), each a command byte and
+ * an ID byte:
+ * 'Q' id -- query: the device answers OK, the number of pages it can take
+ *           per frame and its bitmap of written pages, APP_PAGES bits, page
+ *           0 in the low bit of the first byte. The frames sent to it next
+ *           are numbered from 0. A device that missed the header answers 0
+ *           pages per frame, and must be sent it again before any pages.
+ * 'H' id -- header: followed by the update's header frame, answered as in an
+ *           update, for a device that missed it. A device that already has
+ *           the header discards the frame without answering.
+ * 'F' id -- frame: followed by an update frame, answered with OK or NAK as in
+ *           an update. Devices not addressed discard the frame.
+ * 'B' id -- boot: the device (or every device, for BUS_ALL) finishes the
+ *           update and boots; only a single addressed device answers OK.
+ *
+ * The watchdog is serviced once per frame (or once per page in readback), never
+ * inside the per-byte loops. A frame or page must therefore complete within the
+ * 500ms watchdog period, which a 256 byte page at 9600 baud does with ~200ms
+ * to spare; a host that stalls mid-frame still resets the part.
+ *
+ * Whenever it is waiting for the host with no background work (page erases or
+ * CTR keystream) left, the bootloader idle-sleeps until the next byte arrives,
+ * waking at least every UART1_WAKE_MS to check its deadlines.
+ *
+ * Built with STRIPED=1, for boards with both USARTs wired to the host, the
+ * bootloader also announces update and readback mode on UART0, and can move
+ * bulk data over both ports at once:
+ * - an update frame whose length has FRAME_STRIPED set has the first half of
+ *   its data section (rounded up) sent on UART1 and the second half on UART0,
+ *   at the same time. The length, sequence number and CRC stay on UART1 and
+ *   the CRC still covers the data in order. Both halves are buffered before
+ *   CTR pages are decrypted.
+ * - a readback request with RB_FLAG_STRIPED set is answered the same way:
+ *   each page's IV and first half go out on UART1 and its second half on
+ *   UART0, interleaved byte by byte.
+ * A host that does not see the banner on UART0 keeps to UART1 alone.
+ *
+ * Everything above describes the default UART1 transport. Built with
+ * TRANSPORT=SPI, the bootloader speaks the same protocol as an SPI slave
+ * instead, pacing the host's bridge with a READY line (see spi.c and
+ * transport.h). Deadlines, sleeping and resynchronising work as they do on
+ * UART1. Striping needs both USARTs and so the UART transport.
+ *
+ * The bootloader only touches the hardware through hal.h. Built with
+ * `make native` it runs as a Linux program instead, with flash and EEPROM in
+ * memory and UART1, or a simulated SPI bus, on a pipe or pty (see
+ * hal_linux.c), for benchmarking and testing protocol and crypto changes on
+ * the host.
  *
  */
 
-#include <avr/io.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
-#include <util/delay.h>
-#include <avr/boot.h>
-#include <avr/wdt.h>
-#include <avr/interrupt.h>
-#include <avr/pgmspace.h>
 #include <stdbool.h>
+#include <string.h>
 
-#include "uart.h"
+#include "hal.h"
+#include "transport.h"
 #include "aes.h"
 #include "keys.h"
 
 #define OK    ((unsigned char)0x00)
 #define ERROR ((unsigned char)0x01)
+#define NAK   ((unsigned char)0x02)
 #define IV_SIZE 16
 
+// Each page in an update frame is sent as its page number and IV followed by
+// the page and its tag.
+#define PAGE_NUM_SIZE 2
+#define TAG_SIZE 16
+#define UNIT_SIZE (PAGE_NUM_SIZE + IV_SIZE + SPM_PAGESIZE + TAG_SIZE)
+
+// Flash from here up belongs to the bootloader and is never programmed.
+#define APP_END ((uint32_t)0x1E000)
+#define APP_PAGES (APP_END / SPM_PAGESIZE)
+
+// Update header flags (byte 10 of the header).
+#define HDR_FLAG_CTR      ((unsigned char)0x01)
+#define HDR_FLAG_METADATA ((unsigned char)0x02)
+
+// Number of AES blocks of keystream covering one page.
+#define KS_BLOCKS (SPM_PAGESIZE / IV_SIZE)
+
+// Upper bound on pages per update frame, and the stack left free below the
+// frame buffer for load_firmware()'s callees.
+#define FRAME_PAGES_MAX 32
+#define STACK_RESERVE 1024
+
+// Broadcast update repair commands, and the bus ID every device answers to.
+#define BUS_CMD_QUERY  ((unsigned char)'Q')
+#define BUS_CMD_HEADER ((unsigned char)'H')
+#define BUS_CMD_FRAME  ((unsigned char)'F')
+#define BUS_CMD_BOOT   ((unsigned char)'B')
+#define BUS_ALL        ((uint8_t)0xFF)
+
+#ifndef BUS_ID
+#define BUS_ID 0
+#endif
+
+#ifndef STRIPED
+#define STRIPED 0
+#endif
+
+#if STRIPED && TRANSPORT != TRANSPORT_UART
+#error "STRIPED needs TRANSPORT=UART"
+#endif
+
+// Set in the length of an update frame whose data section is striped across
+// UART1 and UART0.
+#define FRAME_STRIPED ((uint16_t)0x8000)
+
+// Readback request flags (bytes 16-19 of the request, optional).
+#define RB_FLAG_ELIDE_ERASED ((uint32_t)0x00000001)
+#define RB_FLAG_DIGEST       ((uint32_t)0x00000002)
+#define RB_FLAG_STRIPED      ((uint32_t)0x00000004)
+
+// First byte of the first block of each page digest.
+#define DIGEST_LABEL  ((unsigned char)'D')
+
+// First byte of the first block of each tag.
+#define TAG_LABEL_HEADER  ((unsigned char)'H')
+#define TAG_LABEL_REQUEST ((unsigned char)'Q')
+#define TAG_LABEL_PAGE    ((unsigned char)'P')
+
+// Readback record tags, only sent when RB_FLAG_ELIDE_ERASED is set.
+#define RB_RECORD_PAGE   ((unsigned char)'P')
+#define RB_RECORD_ERASED ((unsigned char)'E')
+
 void program_flash(uint32_t page_address, unsigned char *data);
-void load_firmware(void);
+void finish_flash(void);
+void erase_schedule(uint32_t start_addr, uint32_t end_addr);
+void erase_step(void);
+void keystream_step(void);
+void idle_step(void);
+bool receive_byte(unsigned char *data);
+int frame_nak(void);
+int frame_end(unsigned char seq);
+int read_pages(uint8_t max_pages, uint16_t version);
+bool receive_units(uint8_t pages, uint16_t version);
+bool receive_striped(uint8_t pages, uint16_t version);
+void ctr_open(unsigned char *unit, uint16_t version);
+void send_page(uint8_t *output, bool striped);
+void announce(unsigned char mode);
+uint8_t frame_pages_available(void);
+void load_firmware(bool broadcast);
+uint8_t accept_header(unsigned char *data, uint16_t *version);
+void commit_pages(int pages, unsigned char *data, uint16_t version);
+void bus_repair(uint8_t frame_pages, unsigned char *data, uint16_t version);
+bool bus_skip_frame(void);
+bool page_written(uint16_t page);
+void keep_image(uint32_t addr, unsigned char *data);
+void respond(unsigned char c);
 void boot_firmware(void);
 void readback(void);
-void read_frame(unsigned char *data, unsigned char *key);
+void session(void);
+int read_frame(unsigned char *data, unsigned char label);
 void compare_nonces(unsigned char *data);
-void get_key(unsigned char *key);
+void load_keys(void);
+void send_digest(uint8_t *page, uint32_t addr, uint32_t seed);
+void tag_begin(uint8_t *mac, unsigned char label, uint16_t length, uint16_t id,
+               uint16_t extra);
+bool tag_matches(uint8_t *mac, uint8_t *tag);
 void generate_iv(uint8_t *iv, uint32_t seed, bool seed_rng);
+void send_erased_run(uint16_t count);
+void send_word(uint16_t value);
+void send_dword(uint32_t value);
 
-uint16_t fw_size EEMEM = 0;
+uint32_t fw_size EEMEM = 0;
 uint16_t fw_version EEMEM = 0;
+uint8_t bus_id EEMEM = BUS_ID;
+
+// Pages written by the current update, page 0 in the low bit of written[0].
+uint8_t written[APP_PAGES / 8];
+
+// Set while a broadcast update is running, when the bus is shared and only
+// an addressed device may answer. See respond().
+bool bus_quiet = false;
+
+// Set while the frames of a broadcast update are streamed, when sequence
+// numbers are not checked.
+bool bus_update = false;
+
+// Sequence number of the next frame expected, and the CRC of the frame being
+// received (kept up to date by receive_byte()).
+uint8_t frame_seq = 0;
+uint16_t frame_crc;
+
+// Update frames are buffered in the SRAM between the static data and the
+// stack; see frame_pages_available(). Set by main(), since initialized data
+// is never copied to SRAM (see sys_startup.c).
+uint8_t *frame_buf;
+
+// Pages [erase_next, erase_end) are waiting to be erased by erase_step().
+uint16_t erase_next = 0;
+uint16_t erase_end = 0;
+
+// CTR keystream for the page being received. The first ks_ready blocks of
+// keystream are valid; keystream_step() generates the rest from ctr.
+// main() and load_firmware() start ks_ready at KS_BLOCKS, with no keystream
+// owed, since initialized data is never copied to SRAM.
+bool ctr_mode = false;
+uint8_t ctr[IV_SIZE];
+uint8_t keystream[SPM_PAGESIZE];
+uint8_t ks_ready;
+
+// Set for a metadata-only update, which may only program pages from
+// image_end (the installed image's size) up, keeping the image below it.
+bool metadata_only = false;
+uint32_t image_end = 0;
 
 int main(void)
 {
-    // Init UART1 (virtual com port)
-    UART1_init();
+    // Set up the jumper pins first so they have time to settle.
+    hal_init();
+
+    // Init the host transport (UART1, the virtual com port, by default)
+    transport_init();
 
     UART0_init();
-    wdt_reset();
+    UART_timer_init();
+    hal_wdt_reset();
 
-    // Configure Port B Pins 2 and 3 as inputs.
-    DDRB &= ~((1 << PB2) | (1 << PB3));
+    frame_buf = hal_heap_start;
+    ks_ready = KS_BLOCKS;
 
-    // Enable pullups - give port time to settle.
-    PORTB |= (1 << PB2) | (1 << PB3);
+    // Move the interrupt vectors to the boot section for transport_sleep().
+    hal_vectors_boot();
 
+    // If jumpers are present on both pins, run a command session.
+    if(hal_jumper(HAL_JUMPER_UPDATE) && hal_jumper(HAL_JUMPER_READBACK))
+    {
+        transport_putchar('S');
+        session();
+    }
     // If jumper is present on pin 2, load new firmware.
-    if(!(PINB & (1 << PB2)))
+    else if(hal_jumper(HAL_JUMPER_UPDATE))
     {
-        UART1_putchar('U');
-        load_firmware();
+        announce('U');
+        load_firmware(false);
+        boot_firmware();
     }
-    else if(!(PINB & (1 << PB3)))
+    else if(hal_jumper(HAL_JUMPER_READBACK))
     {
-        UART1_putchar('R');
+        announce('R');
         readback();
+
+        // Restart now rather than when the watchdog runs out. While the
+        // jumper is in place that is ready for the next request.
+        hal_wdt_enable(WDTO_15MS);
+        hal_wait_reset(); // Wait for watchdog timer to reset.
     }
     else
     {
-        UART1_putchar('B');
+        transport_putchar('B');
         boot_firmware();
     }
 } // main
 
+/*
+ * Announces the mode on UART1, and in a STRIPED build on UART0 as well so
+ * that a host with both ports connected knows it can stripe.
+ */
+void announce(unsigned char mode)
+{
+    transport_putchar(mode);
+#if STRIPED
+    UART0_putchar(mode);
+#endif
+}
+
 /***********************************************
  **************** BOOT FIRMWARE ****************
  ***********************************************/
@@ -98,35 +408,36 @@ int main(void)
 void boot_firmware(void)
 {
     // Start the Watchdog Timer.
-    wdt_enable(WDTO_500MS);
+    hal_wdt_enable(WDTO_500MS);
 
     // Write out the release message.
     uint8_t cur_byte;
-    uint32_t addr = (uint32_t)eeprom_read_word(&fw_size);
+    uint32_t addr = hal_eeprom_read_dword(&fw_size);
 
     // Reset if firmware size is 0 (indicates no firmware is loaded).
     if(addr == 0)
     {
         // Wait for watchdog timer to reset.
-        while(1) __asm__ __volatile__("");
+        hal_wait_reset();
     }
 
-    wdt_reset();
+    hal_wdt_reset();
 
     // Write out release message to UART0.
     do
     {
-        cur_byte = pgm_read_byte_far(addr);
+        cur_byte = hal_flash_read_byte(addr);
         UART0_putchar(cur_byte);
         ++addr;
-    } while (cur_byte != 0);
+    } while (cur_byte != 0 && addr < APP_END);
 
     // Stop the Watchdog Timer.
-    wdt_reset();
-    wdt_disable();
+    hal_wdt_reset();
+    hal_wdt_disable();
 
-    /* Make the leap of faith. */
-    asm ("jmp 0000");
+    // Hand the interrupt vectors back to the application and make the leap
+    // of faith.
+    hal_start_app();
 }
 
 /***********************************************
@@ -137,19 +448,23 @@ void readback(void)
 {
     uint8_t frame[SPM_PAGESIZE];
     uint8_t output[SPM_PAGESIZE];
-    uint8_t key[IV_SIZE];
     uint8_t iv[IV_SIZE];
     uint32_t addr;
     uint32_t start_addr;
     uint32_t size;
 	uint32_t seed;
+    uint32_t flags = 0;
+    uint16_t erased_run = 0;
+    uint8_t blank;
+    int frame_length;
 
     // Start the Watchdog Timer
-    wdt_enable(WDTO_500MS);
+    hal_wdt_enable(WDTO_500MS);
 
-	// Get key from memory and read header frame
-    get_key(key);
-    read_frame(frame, key);
+	// Get keys from memory and read header frame
+    load_keys();
+    frame_seq = 0;
+    while ((frame_length = read_frame(frame, TAG_LABEL_REQUEST)) < 0);
 
 	// Check for valid decryption
     compare_nonces(frame);
@@ -161,54 +476,112 @@ void readback(void)
     start_addr |= ((uint32_t)frame[7]);
     addr = start_addr;
 
-    wdt_reset();
-
     // Read in size (4 bytes).
     size  = ((uint32_t)frame[8]) << 24;
     size |= ((uint32_t)frame[9]) << 16;
     size |= ((uint32_t)frame[10]) << 8;
     size |= ((uint32_t)frame[11]);
 
-    wdt_reset();
-
     // Read in rng seed (4 bytes).
     seed  = ((uint32_t)frame[12]) << 24;
     seed |= ((uint32_t)frame[13]) << 16;
     seed |= ((uint32_t)frame[14]) << 8;
     seed |= ((uint32_t)frame[15]);
 
-	wdt_reset();
+    // Read in flags (4 bytes), only present in extended requests.
+    if (frame_length >= 20) {
+        flags  = ((uint32_t)frame[16]) << 24;
+        flags |= ((uint32_t)frame[17]) << 16;
+        flags |= ((uint32_t)frame[18]) << 8;
+        flags |= ((uint32_t)frame[19]);
+    }
 
 	// Generate the first IV
 	generate_iv(iv, seed, true);
 
-    // Read the memory out to UART1.
+    // Read the memory out to the host.
     while (addr < start_addr + size)
     {
+        hal_wdt_reset();
+
+        blank = 0xFF;
         for (int i = 0; i < SPM_PAGESIZE; i++) {
-            frame[i] = pgm_read_byte_far(addr++);
-            wdt_reset();
+            frame[i] = hal_flash_read_byte(addr++);
+            blank &= frame[i];
+        }
+
+        // Only the page's digest is sent when the host asked for it.
+        if (flags & RB_FLAG_DIGEST) {
+            send_digest(frame, addr - SPM_PAGESIZE, seed);
+            continue;
+        }
+
+        // Erased pages are counted instead of sent when the host asked for
+        // it; the run is flushed as a single record.
+        if (flags & RB_FLAG_ELIDE_ERASED) {
+            if (blank == 0xFF) {
+                if (++erased_run == 0xFFFF) {
+                    send_erased_run(erased_run);
+                    erased_run = 0;
+                }
+                continue;
+            }
+
+            if (erased_run != 0) {
+                send_erased_run(erased_run);
+                erased_run = 0;
+            }
+
+            transport_putchar(RB_RECORD_PAGE);
         }
 
 		// Encrypt page with CBC
-        AES128_CBC_encrypt_buffer(output, frame, SPM_PAGESIZE, key, iv);
+        AES128_CBC_encrypt_buffer(output, frame, SPM_PAGESIZE, iv);
 
 		// Write IV
 		for (int i = 0; i < IV_SIZE; i++) {
-			UART1_putchar(iv[i]);
+			transport_putchar(iv[i]);
 		}
 
 		// Generate IV for next page
 		generate_iv(iv, 0, false);
 
-        // Write the byte to UART1.
-        for (int i = 0; i < SPM_PAGESIZE; i++) {
-            UART1_putchar(output[i]);
-            wdt_reset();
+        send_page(output, (flags & RB_FLAG_STRIPED) != 0);
+    }
+
+    if (erased_run != 0) {
+        send_erased_run(erased_run);
+    }
+}
+
+/*
+ * Writes an encrypted page to UART1, or in a STRIPED build when striped is
+ * set, its first half to UART1 and its second half to UART0 at once.
+ */
+void send_page(uint8_t *output, bool striped)
+{
+#if STRIPED
+    if (striped) {
+        for (int i = 0; i < SPM_PAGESIZE / 2; i++) {
+            transport_putchar(output[i]);
+            UART0_putchar(output[SPM_PAGESIZE / 2 + i]);
         }
+        return;
     }
+#endif
 
-    while(1) __asm__ __volatile__(""); // Wait for watchdog timer to reset.
+    for (int i = 0; i < SPM_PAGESIZE; i++) {
+        transport_putchar(output[i]);
+    }
+}
+
+/*
+ * Sends a record standing in for count consecutive erased (all 0xFF) pages.
+ */
+void send_erased_run(uint16_t count)
+{
+    transport_putchar(RB_RECORD_ERASED);
+    send_word(count);
 }
 
 /*
@@ -224,17 +597,15 @@ void compare_nonces(unsigned char *data)
     for (int i = 0; i < 4; i++) {
         nonce |= ((uint32_t)data[i]) << (24 - i * 8);
         nonce_val <<= 8;
-        nonce_val |= (uint32_t)eeprom_read_byte(&NONCE[i]);
+        nonce_val |= (uint32_t)hal_eeprom_read_byte(&NONCE[i]);
     }
 
     // Compare nonces
     if (nonce != nonce_val) {
-        UART1_putchar(ERROR); // Reject the metadata.
-        while(1) {
-            __asm__ __volatile__("");
-        }
+        respond(ERROR); // Reject the metadata.
+        hal_wait_reset();
     } else {
-        UART1_putchar(OK);	// Accept metadata
+        respond(OK);	// Accept metadata
     }
 }
 
@@ -251,147 +622,953 @@ void generate_iv(uint8_t *iv, uint32_t seed, bool seed_rng)
 
 	// Fill iv with random numbers
 	for (int i = 0; i < IV_SIZE; i++) {
-		wdt_reset();
 		iv[i] = (uint8_t)rand();
 	}
 }
 
 /*
- * Read key from EEPROM
+ * Loads the round keys of the AES key and the MAC key from EEPROM. bl_build
+ * expands both at build time (the MAC key being the AES encryption of 'K'
+ * followed by zeros), so the raw keys are never on the device.
  */
-void get_key(unsigned char *key)
+void load_keys(void)
 {
-    for (int i = 0; i < IV_SIZE; i++) {
-        key[i] = eeprom_read_byte(&KEY[i]);
-    }
+    AES128_init(KEY_SCHEDULE, MAC_KEY_SCHEDULE);
 }
 
 /* 
- * Reads a frame of data from UART1 and decrypts it in place
+ * Reads a frame of data from the host and decrypts it into data, which must hold
+ * SPM_PAGESIZE bytes. Returns the length of the decrypted data, or -1 if the
+ * frame was NAKed or repeated the last one.
+ *
+ * The watchdog is serviced once, when the frame's first byte arrives.
  */
-void read_frame(unsigned char *data, unsigned char *key)
+int read_frame(unsigned char *data, unsigned char label)
 {
     int frame_length = 0;
     unsigned char rcv = 0;
+    unsigned char seq;
 	unsigned char iv[IV_SIZE];
     unsigned char page[SPM_PAGESIZE];
-    unsigned char output[SPM_PAGESIZE];
+    unsigned char tag[TAG_SIZE];
+    unsigned char mac[TAG_SIZE];
+    int status;
+
+    // Wait for the frame to start. Only the watchdog guards this wait.
+    while (!transport_data_available())
+    {
+        idle_step();
+    }
+
+    transport_timeout_begin();
+    hal_wdt_reset();
+    frame_crc = 0xFFFF;
 
-    // Get two bytes for the length.
-    rcv = UART1_getchar();
+    // Get two bytes for the length, then the sequence number.
+    if (!receive_byte(&rcv)) {
+        return frame_nak();
+    }
     frame_length = (int)rcv << 8;
-    rcv = UART1_getchar();
+    if (!receive_byte(&rcv)) {
+        return frame_nak();
+    }
     frame_length += (int)rcv;
-	frame_length -= IV_SIZE;
+    if (!receive_byte(&seq)) {
+        return frame_nak();
+    }
+
+    // A zero length frame carries no IV or data.
+    if (frame_length == 0) {
+        status = frame_end(seq);
+        if (status >= 0) {
+            respond(OK);
+        }
+        return status > 0 ? 0 : -1;
+    }
+
+	frame_length -= IV_SIZE + TAG_SIZE;
 
-    wdt_reset();
+    // Frames that would overflow the page buffer or are not whole blocks must
+    // have a damaged length.
+    if (frame_length <= 0 || frame_length > SPM_PAGESIZE ||
+        frame_length % IV_SIZE != 0) {
+        return frame_nak();
+    }
     
 	// Read IV for frame
 	for (int i = 0; i < IV_SIZE; i++) {
-		wdt_reset();
-		iv[i] = UART1_getchar();
+		if (!receive_byte(&iv[i])) {
+			return frame_nak();
+		}
 	}
 
     // Receive frame
     for (int i = 0; i < frame_length; ++i) {
-        wdt_reset();
-        page[i] = UART1_getchar();
+        if (!receive_byte(&page[i])) {
+            return frame_nak();
+        }
+    }
+
+    for (int i = 0; i < TAG_SIZE; i++) {
+        if (!receive_byte(&tag[i])) {
+            return frame_nak();
+        }
+    }
+
+    status = frame_end(seq);
+    if (status <= 0) {
+        if (status == 0) {
+            respond(OK);
+        }
+        return -1;
+    }
+
+    // Decrypt and authenticate frame
+    tag_begin(mac, label, frame_length, 0, 0);
+    AES128_MAC_update(mac, iv);
+    AES128_CBC_decrypt_buffer(data, page, frame_length, iv, mac);
+    if (!tag_matches(mac, tag)) {
+        // A device that missed a broadcast's header gets the page frames
+        // while it waits for one, and skips them.
+        if (bus_update && label == TAG_LABEL_HEADER) {
+            return -1;
+        }
+        respond(ERROR);
+        hal_wait_reset(); // Wait for watchdog timer to reset.
     }
 
+    respond(OK); // Acknowledge the frame.
+
+    return frame_length;
+}
+
 /*
-	for (int i = 0; i < IV_SIZE; i++) {
-		UART1_putchar(iv[i]);
-	}
-	for (int i = 0; i < frame_length; ++i) {
-		UART1_putchar(page[i]);
-	}
-*/
-    // Decrypt frame
-    AES128_CBC_decrypt_buffer(output, page, frame_length, key, iv);
-    
-	// Copy data to destination buffer
-    for(int i = 0; i < frame_length; ++i){
-        wdt_reset();
-        data[i] = output[i];
+ * Abandons a frame that timed out or arrived damaged: waits for the line to go
+ * quiet, then NAKs with the number of the frame expected so the host sends it
+ * again.
+ */
+int frame_nak(void)
+{
+    transport_resync();
+#if STRIPED
+    // The rest of a striped frame's second half may still be arriving.
+    UART0_resync();
+#endif
+    respond(NAK);
+    respond(frame_seq);
+    hal_wdt_reset();
+    return -1;
+}
+
+/*
+ * Receives and checks the CRC ending a frame numbered seq. Returns 1 for the
+ * frame expected next, 0 for a repeat of the last frame accepted (the host
+ * missed its OK), or -1 if the frame was NAKed. A frame out of sequence
+ * rejects the update.
+ */
+int frame_end(unsigned char seq)
+{
+    uint16_t crc = frame_crc;
+    unsigned char hi;
+    unsigned char lo;
+
+    if (!receive_byte(&hi) || !receive_byte(&lo)) {
+        return frame_nak();
+    }
+
+    if ((((uint16_t)hi << 8) | lo) != crc) {
+        return frame_nak();
+    }
+
+    if (bus_update || seq == frame_seq) {
+        frame_seq = seq + 1;
+        return 1;
+    }
+
+    if (seq == (uint8_t)(frame_seq - 1)) {
+        return 0;
+    }
+
+    respond(ERROR);
+    hal_wait_reset(); // Wait for watchdog timer to reset.
+}
+
+/***********************************************
+ ******************* SESSION *******************
+ ***********************************************/
+
+void session(void)
+{
+    unsigned char cmd;
+
+    // Start the Watchdog Timer
+    hal_wdt_enable(WDTO_500MS);
+
+    while (1)
+    {
+        // Wait for a command. The watchdog only guards commands in progress.
+        while (!transport_data_available())
+        {
+            hal_wdt_reset();
+            transport_sleep();
+        }
+
+        cmd = transport_getchar();
+        switch (cmd)
+        {
+            case 'S':
+                transport_putchar(cmd);
+                respond(OK);
+                send_word(hal_eeprom_read_word(&fw_version));
+                send_dword(hal_eeprom_read_dword(&fw_size));
+                break;
+            case 'R':
+                transport_putchar(cmd);
+                readback();
+                break;
+            case 'U':
+                transport_putchar(cmd);
+                load_firmware(false);
+                break;
+            case 'M':
+                load_firmware(true);
+                boot_firmware();
+                break;
+            case 'B':
+                transport_putchar(cmd);
+                boot_firmware();
+                break;
+            case 'L':
+                if (transport_getchar() == hal_eeprom_read_byte(&bus_id)) {
+                    transport_putchar(OK);
+                    transport_putchar(frame_pages_available());
+                }
+                break;
+            default:
+                respond(ERROR);
+                break;
+        }
+    }
+}
+
+/*
+ * Sends the digest of the page read from addr: the CBC-MAC of
+ * [ 'D' | addr | seed | 0... ] followed by the page.
+ */
+void send_digest(uint8_t *page, uint32_t addr, uint32_t seed)
+{
+    uint8_t block[IV_SIZE] = { DIGEST_LABEL };
+    uint8_t mac[IV_SIZE] = { 0 };
+
+    for (int i = 0; i < 4; i++) {
+        block[1 + i] = (uint8_t)(addr >> (24 - 8 * i));
+        block[5 + i] = (uint8_t)(seed >> (24 - 8 * i));
+    }
+
+    AES128_MAC_update(mac, block);
+    for (int i = 0; i < SPM_PAGESIZE; i += IV_SIZE) {
+        AES128_MAC_update(mac, page + i);
+    }
+
+    for (int i = 0; i < IV_SIZE; i++) {
+        transport_putchar(mac[i]);
+    }
+}
+
+/*
+ * Starts the MAC for a tag by adding its first block,
+ * [ label | length | id | extra | 0... ], to a zeroed mac.
+ */
+void tag_begin(uint8_t *mac, unsigned char label, uint16_t length, uint16_t id,
+               uint16_t extra)
+{
+    uint8_t block[IV_SIZE] = {
+        label,
+        (uint8_t)(length >> 8), (uint8_t)length,
+        (uint8_t)(id >> 8), (uint8_t)id,
+        (uint8_t)(extra >> 8), (uint8_t)extra
+    };
+
+    memset(mac, 0, IV_SIZE);
+    AES128_MAC_update(mac, block);
+}
+
+/*
+ * Checks the computed mac against the tag that was sent. Every byte is
+ * compared so the time taken does not depend on the tag.
+ */
+bool tag_matches(uint8_t *mac, uint8_t *tag)
+{
+    uint8_t diff = 0;
+
+    for (int i = 0; i < TAG_SIZE; i++) {
+        diff |= mac[i] ^ tag[i];
+    }
+
+    return diff == 0;
+}
+
+/*
+ * Sends a response to the host, unless a broadcast update has the bus.
+ */
+void respond(unsigned char c)
+{
+    if (!bus_quiet) {
+        transport_putchar(c);
     }
+}
+
+/*
+ * Writes a 16-bit value to the host, most significant byte first.
+ */
+void send_word(uint16_t value)
+{
+    transport_putchar((unsigned char)(value >> 8));
+    transport_putchar((unsigned char)value);
+}
 
-    UART1_putchar(OK); // Acknowledge the frame.
+/*
+ * Writes a 32-bit value to the host, most significant byte first.
+ */
+void send_dword(uint32_t value)
+{
+    send_word((uint16_t)(value >> 16));
+    send_word((uint16_t)value);
 }
 
 /***********************************************
  **************** LOAD FIRMWARE ****************
  ***********************************************/
 
-void load_firmware(void)
+/*
+ * Runs an update. In a broadcast update nothing is sent to the host and the
+ * zero-length frame starts the repair phase instead of ending the update.
+ */
+void load_firmware(bool broadcast)
 {
     unsigned char data[SPM_PAGESIZE]; // SPM_PAGESIZE is the size of a page.
-    unsigned char key[IV_SIZE];
-    unsigned int page = 0;
     uint16_t version = 0;
-    uint16_t size = 0;
+    uint8_t frame_pages = 0;
+    int pages;
 
     // Start the Watchdog Timer
-    wdt_enable(WDTO_500MS);
+    hal_wdt_enable(WDTO_500MS);
+
+    bus_quiet = broadcast;
+    bus_update = broadcast;
+    frame_seq = 0;
+    ks_ready = KS_BLOCKS;
+    memset(written, 0, sizeof(written));
+
+	// Get keys from memory and read header frame
+    load_keys();
+    while ((pages = read_frame(data, TAG_LABEL_HEADER)) < 0);
+
+    // A device that missed a broadcast's header only gets the end of the
+    // stream, and waits for the header to be sent again in the repair.
+    if (pages > 0 || !broadcast) {
+        frame_pages = accept_header(data, &version);
+
+        /* Loop here until you can get all your characters and stuff */
+        do {
+            hal_wdt_reset();
+
+            // A NAKed frame will be sent again; a repeated one needs nothing.
+            // A zero length frame ends the update, or the broadcast stream.
+            pages = read_pages(frame_pages, version);
+            if (pages > 0) {
+                commit_pages(pages, data, version);
+                respond(OK); // Acknowledge the frame.
+            }
+        } while (pages != 0);
+    }
 
-    /* Wait for data */
-    while(!UART1_data_available())
-    {
-        __asm__ __volatile__("");
+    if (broadcast) {
+        bus_repair(frame_pages, data, version);
     }
+    finish_flash();
+    respond(OK);
+}
 
-	// Get key from memory and read header frame
-    get_key(key);
-    read_frame(data, key);
+/*
+ * Checks the header frame in data and sets the update up from it: the
+ * version, returned in version, the size and the payload mode. Answers OK
+ * and the number of pages the device takes per frame, which it returns, or
+ * ERROR and waits for the watchdog to reset the device.
+ */
+uint8_t accept_header(unsigned char *data, uint16_t *version)
+{
+    uint32_t size = 0;
+    uint8_t frame_pages;
 
 	// Check for proper decryption
     compare_nonces(data);
 
     // Get version.
-    version  = ((uint16_t)data[4]) << 8;
-    version |= ((uint16_t)data[5]);
+    *version  = ((uint16_t)data[4]) << 8;
+    *version |= ((uint16_t)data[5]);
 
     // Get size.
-    size  = ((uint16_t)data[6]) << 8;
-    size |= ((uint16_t)data[7]);
+    size  = ((uint32_t)data[6]) << 24;
+    size |= ((uint32_t)data[7]) << 16;
+    size |= ((uint32_t)data[8]) << 8;
+    size |= ((uint32_t)data[9]);
+
+    // Get the payload mode.
+    ctr_mode = (data[10] & HDR_FLAG_CTR) != 0;
+    metadata_only = (data[10] & HDR_FLAG_METADATA) != 0;
+    image_end = size;
 
     // Compare to old version and abort if older (note special case for version
-    // 0).
-    if (version != 0 && version < eeprom_read_word(&fw_version))
+    // 0), and reject an image that would run into the bootloader or, for a
+    // metadata-only update, is not the one installed.
+    if ((*version != 0 && *version < hal_eeprom_read_word(&fw_version)) ||
+        size >= APP_END ||
+        (metadata_only && (size == 0 || size != hal_eeprom_read_dword(&fw_size))))
     {
-        UART1_putchar(ERROR); // Reject the metadata.
+        respond(ERROR); // Reject the metadata.
         // Wait for watchdog timer to reset.
-        while(1)
-        {
-            __asm__ __volatile__("");
-        }
+        hal_wait_reset();
     }
-    else if(version != 0)
+    else if(*version != 0)
     {
         // Update version number in EEPROM.
-        wdt_reset();
-        eeprom_update_word(&fw_version, version);
+        hal_eeprom_update_word(&fw_version, *version);
     }
 
     // Write new firmware size to EEPROM.
-    wdt_reset();
-    eeprom_update_word(&fw_size, size);
-    wdt_reset();
+    hal_eeprom_update_dword(&fw_size, size);
+
+    // Accept the metadata and tell the host how many pages fit in a frame.
+    frame_pages = frame_pages_available();
+    respond(OK);
+    respond(frame_pages);
+
+    // Erase the image's pages while the rest of the frames come in. A
+    // metadata-only update erases each page as it programs it.
+    erase_schedule(0, metadata_only ? 0 : size);
+
+    return frame_pages;
+}
+
+/*
+ * Decrypts, authenticates and programs the pages in frame_buf, in the order
+ * they were sent. A page that is outside the application section, already
+ * written, or fails its tag rejects the update, or is skipped in a broadcast
+ * update (so that it shows up as missing in the repair phase).
+ */
+void commit_pages(int pages, unsigned char *data, uint16_t version)
+{
+    unsigned char mac[TAG_SIZE];
+    uint16_t page;
+    bool valid;
+
+    for (int i = 0; i < pages; i++) {
+        unsigned char *unit = frame_buf + i * UNIT_SIZE;
+        unsigned char *iv = unit + PAGE_NUM_SIZE;
+        unsigned char *tag = iv + IV_SIZE + SPM_PAGESIZE;
+
+        // CTR pages were already decrypted and authenticated as they
+        // arrived; read_pages() marks failures with an invalid page number.
+        page = ((uint16_t)unit[0] << 8) | unit[1];
+        valid = page < APP_PAGES && !page_written(page) &&
+                (!metadata_only || page >= image_end / SPM_PAGESIZE);
+
+        if (valid && !ctr_mode) {
+            tag_begin(mac, TAG_LABEL_PAGE, SPM_PAGESIZE, page, version);
+            AES128_MAC_update(mac, iv);
+            AES128_CBC_decrypt_buffer(data, iv + IV_SIZE, SPM_PAGESIZE, iv, mac);
+            valid = tag_matches(mac, tag);
+        }
+
+        if (!valid) {
+            if (bus_quiet) {
+                continue;
+            }
+            respond(ERROR);
+            hal_wait_reset(); // Wait for watchdog timer to reset.
+        }
+
+        if (metadata_only) {
+            keep_image((uint32_t)page * SPM_PAGESIZE, ctr_mode ? iv + IV_SIZE : data);
+        }
+        program_flash((uint32_t)page * SPM_PAGESIZE, ctr_mode ? iv + IV_SIZE : data);
+        written[page / 8] |= 1 << (page % 8);
+        hal_wdt_reset();
+    }
+}
+
+/*
+ * Copies the installed image's bytes in the page at addr (those below
+ * image_end) from flash into data, for a metadata-only update.
+ */
+void keep_image(uint32_t addr, unsigned char *data)
+{
+    // The page just programmed leaves the application section unreadable
+    // until it is re-enabled.
+    hal_rww_enable_safe();
+
+    for (int i = 0; i < SPM_PAGESIZE && addr + i < image_end; i++) {
+        data[i] = hal_flash_read_byte(addr + i);
+    }
+}
+
+bool page_written(uint16_t page)
+{
+    return (written[page / 8] & (1 << (page % 8))) != 0;
+}
+
+/*
+ * Repair phase of a broadcast update: obeys commands addressed to this
+ * device's bus ID until told to boot, staying silent otherwise. Returns to
+ * finish the update only for a boot command.
+ */
+void bus_repair(uint8_t frame_pages, unsigned char *data, uint16_t version)
+{
+    uint8_t id = hal_eeprom_read_byte(&bus_id);
+    unsigned char cmd;
+    unsigned char target;
+    int pages;
+
+    // Repair frames are numbered and checked as in an update, from 0 after
+    // each query.
+    bus_update = false;
 
-    /* Loop here until you can get all your characters and stuff */
     while (1)
     {
-        wdt_reset();
+        // Wait for a command. The watchdog only guards commands in progress.
+        while (!transport_data_available())
+        {
+            hal_wdt_reset();
+            idle_step();
+        }
+
+        cmd = transport_getchar();
+        transport_timeout_begin();
+        if (!receive_byte(&target)) {
+            transport_resync();
+            continue;
+        }
+
+        if (target != id && target != BUS_ALL) {
+            // Frames for other devices are discarded; a boot for another
+            // device is ignored.
+            if ((cmd == BUS_CMD_FRAME || cmd == BUS_CMD_HEADER) &&
+                !bus_skip_frame()) {
+                transport_resync();
+            }
+            continue;
+        }
+
+        bus_quiet = (target == BUS_ALL);
+
+        switch (cmd)
+        {
+            case BUS_CMD_QUERY:
+                frame_seq = 0;
+                respond(OK);
+                respond(frame_pages);
+                for (int i = 0; i < sizeof(written); i++) {
+                    respond(written[i]);
+                }
+                break;
+            case BUS_CMD_HEADER:
+                // Damaged or timed out headers are sent again, as frames are.
+                if (frame_pages != 0) {
+                    if (!bus_skip_frame()) {
+                        transport_resync();
+                    }
+                } else if (read_frame(data, TAG_LABEL_HEADER) > 0) {
+                    frame_pages = accept_header(data, &version);
+                }
+                break;
+            case BUS_CMD_FRAME:
+                // Damaged or timed out frames have been NAKed and will be
+                // sent again.
+                pages = read_pages(frame_pages, version);
+                if (pages > 0) {
+                    commit_pages(pages, data, version);
+                }
+                if (pages >= 0) {
+                    respond(OK);
+                }
+                break;
+            case BUS_CMD_BOOT:
+                return;
+            default:
+                break;
+        }
+
+        bus_quiet = true;
+    }
+}
+
+/*
+ * Reads past an update frame addressed to another device. Returns false if
+ * the frame stalls.
+ */
+bool bus_skip_frame(void)
+{
+    uint16_t remaining;
+    unsigned char rcv;
+
+    transport_timeout_begin();
+    hal_wdt_reset();
+
+    if (!receive_byte(&rcv)) {
+        return false;
+    }
+    remaining = (uint16_t)rcv << 8;
+    if (!receive_byte(&rcv)) {
+        return false;
+    }
+    remaining |= rcv;
+
+    // The sequence number and CRC follow the length.
+    remaining += 3;
+
+    // Deadlines restart at every page, as in read_pages().
+    for (uint16_t i = 0; i < remaining; i++) {
+        if (i % UNIT_SIZE == 0) {
+            transport_timeout_begin();
+            hal_wdt_reset();
+        }
+        if (!receive_byte(&rcv)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Reads an update frame of up to max_pages pages from the host into frame_buf.
+ * Returns the number of pages received, 0 for the frame ending the update, or
+ * -1 if the frame was NAKed or repeated the last one (and acknowledged again).
+ *
+ * The receive deadlines and the watchdog restart at every page.
+ */
+int read_pages(uint8_t max_pages, uint16_t version)
+{
+    uint16_t frame_length;
+    uint8_t pages;
+    unsigned char rcv = 0;
+    unsigned char seq;
+    bool striped = false;
+    bool received;
+    int status;
+
+    // Wait for the frame to start. Only the watchdog guards this wait.
+    while (!transport_data_available())
+    {
+        idle_step();
+    }
+
+    transport_timeout_begin();
+    hal_wdt_reset();
+    frame_crc = 0xFFFF;
+
+    // Get two bytes for the length, then the sequence number.
+    if (!receive_byte(&rcv)) {
+        return frame_nak();
+    }
+    frame_length = (uint16_t)rcv << 8;
+    if (!receive_byte(&rcv)) {
+        return frame_nak();
+    }
+    frame_length |= rcv;
+    if (!receive_byte(&seq)) {
+        return frame_nak();
+    }
+
+#if STRIPED
+    striped = (frame_length & FRAME_STRIPED) != 0;
+    frame_length &= ~FRAME_STRIPED;
+#endif
+
+    // Frames that are not whole pages or would overflow frame_buf must have a
+    // damaged length.
+    pages = frame_length / UNIT_SIZE;
+    if (frame_length % UNIT_SIZE != 0 || pages > max_pages) {
+        return frame_nak();
+    }
+
+    received = striped ? receive_striped(pages, version)
+                       : receive_units(pages, version);
+    if (!received) {
+        return frame_nak();
+    }
+
+    // Nothing received is used until the CRC has been checked. (CTR pages are
+    // decrypted in frame_buf as they arrive, but only programmed afterwards.)
+    status = frame_end(seq);
+    if (status <= 0) {
+        if (status == 0) {
+            respond(OK);
+        }
+        return -1;
+    }
+
+    return pages;
+}
+
+/*
+ * Receives the data section of an update frame of pages pages into frame_buf,
+ * decrypting and authenticating CTR pages as they arrive. Returns false if a
+ * receive deadline passes.
+ *
+ * The receive deadlines and the watchdog restart at every page.
+ */
+bool receive_units(uint8_t pages, uint16_t version)
+{
+    unsigned char mac[TAG_SIZE];
+
+    for (int i = 0; i < pages; i++) {
+        unsigned char *unit = frame_buf + i * UNIT_SIZE;
+        unsigned char *body = unit + PAGE_NUM_SIZE + IV_SIZE;
+        unsigned char *tag = body + SPM_PAGESIZE;
+
+        transport_timeout_begin();
+        hal_wdt_reset();
+
+        // Page number and IV.
+        for (int j = 0; j < PAGE_NUM_SIZE + IV_SIZE; j++) {
+            if (!receive_byte(&unit[j])) {
+                return false;
+            }
+        }
+
+        // Start generating this page's keystream from its IV, and its MAC.
+        if (ctr_mode) {
+            memcpy(ctr, unit + PAGE_NUM_SIZE, IV_SIZE);
+            ks_ready = 0;
+
+            tag_begin(mac, TAG_LABEL_PAGE, SPM_PAGESIZE,
+                      ((uint16_t)unit[0] << 8) | unit[1], version);
+            AES128_MAC_update(mac, unit + PAGE_NUM_SIZE);
+        }
+
+        for (int j = 0; j < SPM_PAGESIZE; j++) {
+            if (!receive_byte(&body[j])) {
+                return false;
+            }
+
+            // Each block is added to the MAC and then decrypted as soon as
+            // its last byte arrives.
+            if (ctr_mode && j % IV_SIZE == IV_SIZE - 1) {
+                unsigned char *block = body + j + 1 - IV_SIZE;
+
+                AES128_MAC_update(mac, block);
+
+                // Only waits here if the bytes outrun the idle-time keystream.
+                while (j / IV_SIZE >= ks_ready) {
+                    keystream_step();
+                }
+                for (int k = 0; k < IV_SIZE; k++) {
+                    block[k] ^= keystream[block - body + k];
+                }
+            }
+        }
+
+        for (int j = 0; j < TAG_SIZE; j++) {
+            if (!receive_byte(&tag[j])) {
+                return false;
+            }
+        }
+
+        // A page that fails its tag is marked with an invalid page number
+        // for commit_pages() to reject.
+        if (ctr_mode && !tag_matches(mac, tag)) {
+            unit[0] = 0xFF;
+            unit[1] = 0xFF;
+        }
+    }
+
+    return true;
+}
+
+#if STRIPED
+/*
+ * Receives the data section of a striped update frame into frame_buf, the
+ * first half from UART1 and the second half from UART0 at the same time, then
+ * adds it to frame_crc in order and opens any CTR pages. Returns false if a
+ * receive deadline passes.
+ *
+ * Only UART1 can wake the CPU, so this polls both ports rather than
+ * sleeping. The deadlines and the watchdog restart with every page's worth of
+ * bytes received.
+ */
+bool receive_striped(uint8_t pages, uint16_t version)
+{
+    uint16_t length = pages * UNIT_SIZE;
+    uint16_t half = (length + 1) / 2;
+    uint16_t low = 0;
+    uint16_t high = half;
+    uint16_t since_restart = 0;
+
+    while (low < half || high < length) {
+        bool got = false;
+
+        // Both ports are read on every pass so that neither overruns.
+        if (low < half && transport_data_available()) {
+            frame_buf[low++] = transport_getchar();
+            since_restart++;
+            got = true;
+        }
+        if (high < length && UART0_data_available()) {
+            frame_buf[high++] = UART0_getchar();
+            since_restart++;
+            got = true;
+        }
+
+        if (!got) {
+            if (transport_timeout_expired()) {
+                return false;
+            }
+            erase_step();
+        } else if (since_restart >= UNIT_SIZE) {
+            since_restart = 0;
+            transport_timeout_begin();
+            hal_wdt_reset();
+        }
+    }
+
+    for (uint16_t i = 0; i < length; i++) {
+        frame_crc = _crc_ccitt_update(frame_crc, frame_buf[i]);
+    }
+
+    if (ctr_mode) {
+        for (int i = 0; i < pages; i++) {
+            ctr_open(frame_buf + i * UNIT_SIZE, version);
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Decrypts and authenticates a whole CTR page received in a striped frame,
+ * marking it with an invalid page number if it fails its tag, as
+ * receive_units() does.
+ */
+void ctr_open(unsigned char *unit, uint16_t version)
+{
+    unsigned char *body = unit + PAGE_NUM_SIZE + IV_SIZE;
+    unsigned char mac[TAG_SIZE];
+    unsigned char block[IV_SIZE];
+
+    memcpy(ctr, unit + PAGE_NUM_SIZE, IV_SIZE);
+    tag_begin(mac, TAG_LABEL_PAGE, SPM_PAGESIZE,
+              ((uint16_t)unit[0] << 8) | unit[1], version);
+    AES128_MAC_update(mac, unit + PAGE_NUM_SIZE);
+
+    for (int j = 0; j < SPM_PAGESIZE; j += IV_SIZE) {
+        AES128_MAC_update(mac, body + j);
+        AES128_CTR_keystream(block, ctr);
+        for (int k = 0; k < IV_SIZE; k++) {
+            body[j + k] ^= block[k];
+        }
+    }
+
+    if (!tag_matches(mac, body + SPM_PAGESIZE)) {
+        unit[0] = 0xFF;
+        unit[1] = 0xFF;
+    }
+}
+#endif
+
+/*
+ * Number of pages an update frame may carry: as many as fit between the end of
+ * the static data and the stack, less STACK_RESERVE, up to FRAME_PAGES_MAX.
+ */
+uint8_t frame_pages_available(void)
+{
+    uint16_t free = hal_sram_free(frame_buf);
+    uint16_t pages;
+
+    if (free < STACK_RESERVE + UNIT_SIZE) {
+        return 1;
+    }
+
+    pages = (free - STACK_RESERVE) / UNIT_SIZE;
+    return pages > FRAME_PAGES_MAX ? FRAME_PAGES_MAX : pages;
+}
+
 
-        read_frame(data, key);
 
-		wdt_reset();
-		program_flash(page, data);
-		page += SPM_PAGESIZE;
+
+/*
+ * Receives the next byte of a frame from the host and adds it to frame_crc,
+ * erasing scheduled pages and generating keystream while waiting for it.
+ * Returns false if a receive deadline passes first.
+ */
+bool receive_byte(unsigned char *data)
+{
+    while (!transport_data_available())
+    {
+        if (transport_timeout_expired())
+        {
+            return false;
+        }
+        idle_step();
     }
+    *data = transport_getchar();
+    frame_crc = _crc_ccitt_update(frame_crc, *data);
+    return true;
 }
 
+/*
+ * One step of background work while waiting for the host, or a sleep until the
+ * next byte if there is none. A page erase still in progress is left to
+ * finish during the sleep.
+ */
+void idle_step(void)
+{
+    if (erase_next < erase_end || ks_ready < KS_BLOCKS)
+    {
+        erase_step();
+        keystream_step();
+    }
+    else
+    {
+        transport_sleep();
+    }
+}
 
+/*
+ * Schedules the pages covering [start_addr, end_addr) for erasing.
+ */
+void erase_schedule(uint32_t start_addr, uint32_t end_addr)
+{
+    erase_next = start_addr / SPM_PAGESIZE;
+    erase_end = (end_addr + SPM_PAGESIZE - 1) / SPM_PAGESIZE;
+}
+
+/*
+ * Starts erasing the next scheduled page if the SPM unit is idle. Never
+ * waits, so it can be called from polling loops.
+ */
+void erase_step(void)
+{
+    if (erase_next < erase_end && !hal_spm_busy() && hal_eeprom_ready())
+    {
+        hal_page_erase((uint32_t)erase_next * SPM_PAGESIZE);
+        ++erase_next;
+    }
+}
 
+/*
+ * Generates the next block of CTR keystream for the page being received, if
+ * any is still missing. Takes one AES block operation.
+ */
+void keystream_step(void)
+{
+    if (ks_ready < KS_BLOCKS)
+    {
+        AES128_CTR_keystream(keystream + ks_ready * IV_SIZE, ctr);
+        ++ks_ready;
+    }
+}
 
 /*
  * To program flash, you need to access and program it in pages
@@ -403,21 +1580,49 @@ void load_firmware(void)
  * 3. Writing a page
  * 4. When you are done programming all of your pages, enable the flash
  *
+ * Pages inside the scheduled erase range are normally erased by erase_step()
+ * before their data arrives; if the scheduler has fallen behind, it is caught
+ * up here. A sparse image can leave hundreds of pages to catch up on, far
+ * longer than the watchdog period, so the watchdog is reset at each one. Pages
+ * outside the range are erased right before they are written.
+ *
  * You must fill the buffer one word at a time
  */
 void program_flash(uint32_t page_address, unsigned char *data)
 {
     int i = 0;
-    boot_page_erase_safe(page_address);
+    uint16_t page = page_address / SPM_PAGESIZE;
+
+    if (page < erase_end)
+    {
+        while (erase_next <= page)
+        {
+            hal_page_erase_safe((uint32_t)erase_next * SPM_PAGESIZE);
+            ++erase_next;
+            hal_wdt_reset();
+        }
+    }
+    else
+    {
+        hal_page_erase_safe(page_address);
+    }
 
     for(i = 0; i < SPM_PAGESIZE; i += 2)
     {
         uint16_t w = data[i];    // Make a word out of two bytes
         w += data[i+1] << 8;
-        boot_page_fill_safe(page_address+i, w);
+        hal_page_fill_safe(page_address+i, w);
     }
 
-    boot_page_write_safe(page_address);
-    boot_rww_enable_safe(); // We can just enable it after every program too
+    hal_page_write_safe(page_address);
 }
 
+/*
+ * Stops the erase scheduler and re-enables the RWW section once the last
+ * write has finished.
+ */
+void finish_flash(void)
+{
+    erase_end = erase_next;
+    hal_rww_enable_safe();
+}
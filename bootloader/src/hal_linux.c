@@ -0,0 +1,614 @@
+/*
+ * Linux backend of the hardware abstraction layer, and the UART driver to go
+ * with it, for running the bootloader as a native program (make native).
+ *
+ * The program behaves like one run of the bootloader from reset. It is set
+ * up through the environment:
+ *   BL_MODE    jumpers fitted: U (update), R (readback), S (both, a command
+ *              session) or anything else for none (boot).
+ *   BL_UART1   file (a pty, say) to use as UART1; stdin and stdout if unset.
+ *              "pty" opens a new pseudo-terminal, prints the name of its
+ *              other end on stderr and waits for the host to open it. The
+ *              program then only ends once the host has closed it again, as
+ *              a board's serial port outlives the bootloader.
+ *   BL_UART0   file UART0 output (the release message) goes to; stderr if
+ *              unset. UART0 never receives anything.
+ *   BL_FLASH   raw image of the 128 KB flash, loaded at start if it exists
+ *              (erased otherwise) and saved whenever the program ends.
+ *   BL_EEPROM  raw image of the EEMEM variables, handled the same way. A
+ *              new one starts from the values in the source and keys.h.
+ *   BL_SPM_US  microseconds each page erase or write keeps the SPM unit busy,
+ *              as on the part (4500 there); 0, instant, if unset.
+ *
+ * In a TRANSPORT=SPI build, UART1's file carries a simulated SPI bus instead,
+ * with the host as the master. Each byte the host writes clocks one transfer,
+ * which the bootloader answers with 'D' and the byte it shifted out; it sends
+ * 'R' whenever it toggles READY. As on the part, a transfer happens as soon as
+ * the host clocks it, whatever the bootloader is doing: a byte it has not
+ * taken yet is overwritten, and unless it loads another, the byte shifted in
+ * is shifted out again next time.
+ *
+ * The program ends where the part would stop running the bootloader: with
+ * status HAL_EXIT_BOOT when it jumps to the application, or HAL_EXIT_RESET
+ * when it waits for, or is caught by, the watchdog.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hal.h"
+#include "uart.h"
+
+#if HAL_LINUX
+
+#define HAL_EXIT_BOOT  0
+#define HAL_EXIT_RESET 3
+
+uint8_t hal_flash[HAL_FLASH_SIZE];
+uint8_t hal_sram[HAL_SRAM_FREE];
+
+// The EEMEM variables, placed together by the linker.
+extern uint8_t __start_eeprom[];
+extern uint8_t __stop_eeprom[];
+
+static uint8_t page_buf[SPM_PAGESIZE];
+
+static unsigned int wdt_period;
+static uint8_t jumpers;
+
+// How long each page erase or write takes, and when the one started last ends.
+static long spm_us;
+static struct timespec spm_done;
+
+static int uart1_in = 0;
+static int uart1_out = 1;
+static int uart0_out = 2;
+static bool uart1_pty;
+
+// The SPI peripheral, shared with the thread that does the transfers: the
+// byte to shift out next, the byte last shifted in and SPIF.
+static pthread_mutex_t spi_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t spi_done = PTHREAD_COND_INITIALIZER;
+static uint8_t spi_out;
+static uint8_t spi_in;
+static bool spi_flag;
+
+static uint8_t rx_buf[4096];
+static unsigned int rx_head;
+static unsigned int rx_len;
+static uint8_t tx_buf[4096];
+static unsigned int tx_len;
+
+// Timer values at the start of the current frame and at the last byte.
+static uint16_t frame_start;
+static uint16_t byte_start;
+
+/* Read path into buf if it holds exactly size bytes. */
+static void load_image(const char *path, uint8_t *buf, size_t size)
+{
+    int fd;
+
+    if (path == NULL || (fd = open(path, O_RDONLY)) < 0) {
+        return;
+    }
+    if (lseek(fd, 0, SEEK_END) == (off_t)size) {
+        lseek(fd, 0, SEEK_SET);
+        if (read(fd, buf, size) != (ssize_t)size) {
+            memset(buf, 0xFF, size);
+        }
+    }
+    close(fd);
+}
+
+/* Only calls that are safe in the watchdog's signal handler. */
+static void save_image(const char *path, const uint8_t *buf, size_t size)
+{
+    int fd;
+
+    if (path == NULL || (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        return;
+    }
+    if (write(fd, buf, size) != (ssize_t)size) {
+        // Nothing more can be done on the way out.
+    }
+    close(fd);
+}
+
+static void tx_flush(void)
+{
+    unsigned int done = 0;
+
+    while (done < tx_len) {
+        ssize_t n = write(uart1_out, tx_buf + done, tx_len - done);
+        if (n <= 0 && errno != EINTR) {
+            break;
+        }
+        if (n > 0) {
+            done += n;
+        }
+    }
+    tx_len = 0;
+}
+
+static void __attribute__((noreturn)) hal_exit(int status)
+{
+    struct itimerval timer = {{0, 0}, {0, 0}};
+    struct pollfd pfd = {uart1_in, POLLIN, 0};
+
+    setitimer(ITIMER_REAL, &timer, NULL);
+    tx_flush();
+    save_image(getenv("BL_FLASH"), hal_flash, sizeof(hal_flash));
+    save_image(getenv("BL_EEPROM"), __start_eeprom, __stop_eeprom - __start_eeprom);
+
+    while (uart1_pty && !(pfd.revents & POLLHUP)) {
+        usleep(10000);
+        poll(&pfd, 1, 0);
+    }
+    _exit(status);
+}
+
+static void wdt_expired(int sig)
+{
+    (void)sig;
+    hal_exit(HAL_EXIT_RESET);
+}
+
+/* A new pseudo-terminal for UART1. Returns once the host has opened the other
+ * end, as a board is reset after the host has its port open.
+ */
+static int open_pty(void)
+{
+    struct pollfd pfd = {-1, POLLIN, 0};
+    struct termios tio;
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0 || tcgetattr(fd, &tio) < 0) {
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+
+    // The master only reports a hangup once the other end has been opened and
+    // closed again, so do that first and wait for the hangup to clear.
+    close(open(ptsname(fd), O_RDWR | O_NOCTTY));
+    dprintf(2, "UART1: %s\n", ptsname(fd));
+
+    pfd.fd = fd;
+    do {
+        usleep(10000);
+        poll(&pfd, 1, 0);
+    } while (pfd.revents & POLLHUP);
+
+    // Opening a port discards its input; let the host finish first.
+    usleep(100000);
+    return fd;
+}
+
+void hal_init(void)
+{
+    const char *mode = getenv("BL_MODE");
+    const char *path;
+
+    memset(hal_flash, 0xFF, sizeof(hal_flash));
+    memset(page_buf, 0xFF, sizeof(page_buf));
+    if ((path = getenv("BL_SPM_US")) != NULL) {
+        spm_us = atol(path);
+    }
+    load_image(getenv("BL_FLASH"), hal_flash, sizeof(hal_flash));
+    load_image(getenv("BL_EEPROM"), __start_eeprom, __stop_eeprom - __start_eeprom);
+
+    if ((path = getenv("BL_UART1")) != NULL) {
+        uart1_pty = strcmp(path, "pty") == 0;
+        uart1_in = uart1_out = uart1_pty ? open_pty() : open(path, O_RDWR | O_NOCTTY);
+        if (uart1_in < 0) {
+            _exit(1);
+        }
+    }
+    if ((path = getenv("BL_UART0")) != NULL) {
+        uart0_out = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY, 0644);
+        if (uart0_out < 0) {
+            _exit(1);
+        }
+    }
+
+    if (mode != NULL) {
+        if (*mode == 'U' || *mode == 'S') {
+            jumpers |= HAL_JUMPER_UPDATE;
+        }
+        if (*mode == 'R' || *mode == 'S') {
+            jumpers |= HAL_JUMPER_READBACK;
+        }
+    }
+
+    signal(SIGALRM, wdt_expired);
+}
+
+bool hal_jumper(uint8_t pin)
+{
+    return (jumpers & pin) != 0;
+}
+
+void hal_start_app(void)
+{
+    hal_exit(HAL_EXIT_BOOT);
+}
+
+/***********************************************
+ ******************** FLASH ********************
+ ***********************************************/
+
+/* Mark the SPM unit busy for the next spm_us. */
+static void spm_start(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &spm_done);
+    spm_done.tv_nsec += spm_us * 1000;
+    spm_done.tv_sec += spm_done.tv_nsec / 1000000000L;
+    spm_done.tv_nsec %= 1000000000L;
+}
+
+/* Wait for the erase or write in progress to end, as the _safe calls do. */
+static void spm_wait(void)
+{
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &spm_done, NULL) == EINTR);
+}
+
+bool hal_spm_busy(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec < spm_done.tv_sec ||
+           (now.tv_sec == spm_done.tv_sec && now.tv_nsec < spm_done.tv_nsec);
+}
+
+void hal_page_erase(uint32_t addr)
+{
+    memset(hal_flash + (addr & ~(uint32_t)(SPM_PAGESIZE - 1)) % HAL_FLASH_SIZE,
+           0xFF, SPM_PAGESIZE);
+    spm_start();
+}
+
+void hal_page_erase_safe(uint32_t addr)
+{
+    spm_wait();
+    hal_page_erase(addr);
+}
+
+void hal_page_fill_safe(uint32_t addr, uint16_t word)
+{
+    spm_wait();
+    page_buf[addr % SPM_PAGESIZE] = (uint8_t)word;
+    page_buf[(addr + 1) % SPM_PAGESIZE] = (uint8_t)(word >> 8);
+}
+
+/* Programming only clears bits, as on the part, so a page that was not
+ * erased first comes out wrong.
+ */
+void hal_page_write_safe(uint32_t addr)
+{
+    uint8_t *page = hal_flash + (addr & ~(uint32_t)(SPM_PAGESIZE - 1)) % HAL_FLASH_SIZE;
+
+    spm_wait();
+    for (int i = 0; i < SPM_PAGESIZE; i++) {
+        page[i] &= page_buf[i];
+    }
+    memset(page_buf, 0xFF, sizeof(page_buf));
+    spm_start();
+}
+
+void hal_rww_enable_safe(void)
+{
+    spm_wait();
+}
+
+/***********************************************
+ ************** WATCHDOG AND TIMER *************
+ ***********************************************/
+
+void hal_wdt_enable(unsigned int ms)
+{
+    wdt_period = ms;
+    hal_wdt_reset();
+}
+
+void hal_wdt_reset(void)
+{
+    struct itimerval timer = {{0, 0}, {wdt_period / 1000, (wdt_period % 1000) * 1000}};
+
+    if (wdt_period != 0) {
+        setitimer(ITIMER_REAL, &timer, NULL);
+    }
+}
+
+void hal_wdt_disable(void)
+{
+    struct itimerval timer = {{0, 0}, {0, 0}};
+
+    wdt_period = 0;
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+void hal_wait_reset(void)
+{
+    hal_exit(HAL_EXIT_RESET);
+}
+
+uint16_t hal_timer_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint16_t)(((uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec) /
+                      (1000000000ULL / (F_CPU / 1024UL)));
+}
+
+/***********************************************
+ ******************** UARTS ********************
+ ***********************************************/
+
+/* Wait up to timeout ms (forever if negative) for UART1 input. */
+static void rx_fill(int timeout)
+{
+    struct pollfd pfd = {uart1_in, POLLIN, 0};
+    ssize_t n;
+
+    if (rx_len != 0) {
+        return;
+    }
+    tx_flush();
+    if (poll(&pfd, 1, timeout) <= 0 || !(pfd.revents & POLLIN)) {
+        // A closed link has no more to give; don't spin on it.
+        if (pfd.revents & POLLHUP) {
+            usleep(timeout > 0 ? timeout * 1000 : 1000);
+        }
+        return;
+    }
+
+    n = read(uart1_in, rx_buf, sizeof(rx_buf));
+    if (n > 0) {
+        rx_head = 0;
+        rx_len = n;
+    }
+}
+
+void UART_timer_init(void)
+{
+}
+
+void UART_timer_byte(void)
+{
+    byte_start = hal_timer_now();
+}
+
+bool UART_timer_byte_expired(void)
+{
+    return (uint16_t)(hal_timer_now() - byte_start) > UART_TIMER_TICKS(UART1_BYTE_TIMEOUT_MS);
+}
+
+void UART1_init(void)
+{
+}
+
+void UART1_putchar(unsigned char data)
+{
+    if (tx_len == sizeof(tx_buf)) {
+        tx_flush();
+    }
+    tx_buf[tx_len++] = data;
+}
+
+bool UART1_data_available(void)
+{
+    rx_fill(0);
+    return rx_len != 0;
+}
+
+unsigned char UART1_getchar(void)
+{
+    unsigned char data;
+
+    while (rx_len == 0) {
+        rx_fill(-1);
+    }
+    data = rx_buf[rx_head++];
+    rx_len--;
+
+    byte_start = hal_timer_now();
+    return data;
+}
+
+void UART1_sleep(void)
+{
+    rx_fill(UART1_WAKE_MS);
+}
+
+void UART1_flush(void)
+{
+    while (UART1_data_available()) {
+        UART1_getchar();
+    }
+}
+
+void UART1_putstring(char* str)
+{
+    int i = 0;
+    while (str[i] != 0) {
+        UART1_putchar(str[i]);
+        i += 1;
+    }
+    UART1_putchar((unsigned char)0);
+}
+
+void UART1_timeout_begin(void)
+{
+    frame_start = hal_timer_now();
+    byte_start = frame_start;
+}
+
+bool UART1_timeout_expired(void)
+{
+    uint16_t now = hal_timer_now();
+
+    return (uint16_t)(now - frame_start) > UART_TIMER_TICKS(UART1_FRAME_TIMEOUT_MS) ||
+           (uint16_t)(now - byte_start) > UART_TIMER_TICKS(UART1_BYTE_TIMEOUT_MS);
+}
+
+void UART1_resync(void)
+{
+    UART_timer_byte();
+    while (!UART_timer_byte_expired()) {
+        if (UART1_data_available()) {
+            UART1_getchar();
+        } else {
+            UART1_sleep();
+        }
+    }
+}
+
+/***********************************************
+ ********************* SPI *********************
+ ***********************************************/
+
+/* The SPI bus: does each transfer the host clocks. */
+static void *spi_bus(void *arg)
+{
+    uint8_t reply[2] = {'D', 0};
+    uint8_t byte;
+    sigset_t alarm;
+    ssize_t n;
+
+    (void)arg;
+    // The watchdog is for the bootloader's thread.
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm, NULL);
+
+    for (;;) {
+        n = read(uart1_in, &byte, 1);
+        if (n <= 0) {
+            // A closed link has no more to give; don't spin on it.
+            if (n == 0 || errno != EINTR) {
+                usleep(10000);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&spi_lock);
+        reply[1] = spi_out;
+        if (write(uart1_out, reply, sizeof(reply)) != sizeof(reply)) {
+            // The host has gone; the bootloader finds out by its deadlines.
+        }
+        spi_out = byte;
+        spi_in = byte;
+        __atomic_store_n(&spi_flag, true, __ATOMIC_RELEASE);
+        pthread_cond_signal(&spi_done);
+        pthread_mutex_unlock(&spi_lock);
+    }
+    return NULL;
+}
+
+void hal_spi_init(void)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, spi_bus, NULL) != 0) {
+        _exit(1);
+    }
+}
+
+void hal_spi_load(uint8_t byte)
+{
+    pthread_mutex_lock(&spi_lock);
+    spi_out = byte;
+    pthread_mutex_unlock(&spi_lock);
+}
+
+bool hal_spi_clocked(void)
+{
+    return __atomic_load_n(&spi_flag, __ATOMIC_ACQUIRE);
+}
+
+uint8_t hal_spi_take(void)
+{
+    uint8_t byte;
+
+    pthread_mutex_lock(&spi_lock);
+    byte = spi_in;
+    spi_flag = false;
+    pthread_mutex_unlock(&spi_lock);
+    return byte;
+}
+
+void hal_ready_toggle(void)
+{
+    if (write(uart1_out, "R", 1) != 1) {
+        // As for a transfer's reply.
+    }
+}
+
+void hal_spi_wait(unsigned int ms)
+{
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += ms * 1000000L;
+    until.tv_sec += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+
+    pthread_mutex_lock(&spi_lock);
+    while (!spi_flag && pthread_cond_timedwait(&spi_done, &spi_lock, &until) == 0);
+    pthread_mutex_unlock(&spi_lock);
+}
+
+void UART0_init(void)
+{
+}
+
+void UART0_putchar(unsigned char data)
+{
+    if (write(uart0_out, &data, 1) != 1) {
+        // UART0 output is only informational.
+    }
+}
+
+bool UART0_data_available(void)
+{
+    return false;
+}
+
+unsigned char UART0_getchar(void)
+{
+    hal_wait_reset();
+}
+
+void UART0_flush(void)
+{
+}
+
+void UART0_resync(void)
+{
+}
+
+void UART0_putstring(char* str)
+{
+    int i = 0;
+    while (str[i] != 0) {
+        UART0_putchar(str[i]);
+        i += 1;
+    }
+    UART0_putchar((unsigned char)0);
+}
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * SPI slave driver code, used when the bootloader is built with
+ * TRANSPORT=SPI.
+ *
+ * The host bridge is the SPI master and clocks every byte, in either
+ * direction, so the bootloader paces it with the READY line: it toggles
+ * READY once for each byte it is ready to exchange, having loaded SPDR first
+ * if it is sending, and the bridge clocks exactly one byte per toggle. A byte
+ * the bridge clocks while the bootloader is sending carries nothing; a byte
+ * the bootloader sends while receiving is 0xFF.
+ *
+ * The peripheral and READY are reached through hal.h, so this driver also
+ * runs in the native build, against the SPI bus hal_linux.c simulates.
+ * Receive deadlines are the Timer1 ones in uart.c.
+ */
+
+#include "hal.h"
+#include "transport.h"
+
+#if !HAL_LINUX
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#endif
+
+#if TRANSPORT == TRANSPORT_SPI
+
+// Set while READY has been toggled for a byte the bridge has not clocked yet.
+static bool armed;
+
+// Set by the SPI interrupt, which clears SPIF, when it wakes SPI_sleep().
+static volatile bool received;
+
+#if !HAL_LINUX
+/* Wake-up interrupt for SPI_sleep(). Entering it clears SPIF, so it records
+ * the byte in received.
+ */
+ISR(SPI_STC_vect)
+{
+    SPCR &= ~(1 << SPIE);
+    TIMSK1 &= ~(1 << OCIE1A);
+    received = true;
+}
+#endif
+
+/* init SPI
+ * Slave mode 0, MISO and READY driven, everything else an input.
+ */
+void SPI_init(void)
+{
+    hal_spi_init();
+    hal_spi_load(0xFF);
+}
+
+static void SPI_arm(void)
+{
+    if (!armed)
+    {
+        armed = true;
+        hal_ready_toggle();
+    }
+}
+
+static bool SPI_done(void)
+{
+    return received || hal_spi_clocked();
+}
+
+void SPI_putchar(unsigned char data)
+{
+    // A byte the bridge already clocked for an earlier SPI_arm() is
+    // discarded. Otherwise data goes out in the slot READY already offers.
+    if (armed && SPI_done())
+    {
+        SPI_getchar();
+    }
+
+    hal_spi_load(data);
+    SPI_arm();
+    while (!SPI_done())
+    {
+        // Wait for the bridge to clock it out.
+    }
+    SPI_getchar();
+}
+
+bool SPI_data_available(void)
+{
+    SPI_arm();
+    return SPI_done();
+}
+
+unsigned char SPI_getchar(void)
+{
+    unsigned char data;
+
+    while (!SPI_data_available())
+    {
+        /* Wait for data to be received */
+    }
+    data = hal_spi_take();
+    hal_spi_load(0xFF);
+    armed = false;
+    received = false;
+
+    /* Restart the byte deadline and return received data */
+    UART_timer_byte();
+    return data;
+}
+
+/* Idle-sleep until the bridge clocks a byte, or for at most UART1_WAKE_MS,
+ * without offering it one.
+ */
+static void SPI_idle(void)
+{
+#if HAL_LINUX
+    hal_spi_wait(UART1_WAKE_MS);
+#else
+    cli();
+    OCR1A = TCNT1 + UART_TIMER_TICKS(UART1_WAKE_MS);
+    TIFR1 = (1 << OCF1A);
+    TIMSK1 |= (1 << OCIE1A);
+    SPCR |= (1 << SPIE);
+
+    // As in UART1_sleep(), sei() only takes effect after sleep_cpu().
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    cli();
+    SPCR &= ~(1 << SPIE);
+#endif
+}
+
+/* Idle-sleep until the bridge clocks a byte, or for at most UART1_WAKE_MS.
+ * Returns straight away if a byte is already waiting.
+ */
+void SPI_sleep(void)
+{
+    SPI_arm();
+    SPI_idle();
+}
+
+void SPI_flush(void)
+{
+    while (armed && SPI_done())
+    {
+        SPI_getchar();
+    }
+}
+
+/* Wait out a byte timeout before a NAK, discarding a byte the bridge clocked
+ * for the last toggle of READY. READY is not toggled again: the host is
+ * waiting for the answer and would clock a 0xFF for every toggle, restarting
+ * the timeout each time, so the NAK would never be sent.
+ */
+void SPI_resync(void)
+{
+    UART_timer_byte();
+    while (!UART_timer_byte_expired())
+    {
+        if (armed && SPI_done())
+        {
+            SPI_getchar();
+        }
+        else
+        {
+            SPI_idle();
+        }
+    }
+}
+
+#endif
@@ -1,10 +1,60 @@
 #include <avr/io.h>
 #include <avr/wdt.h>
+#include "transport.h"
 
-void __Init         (void) __attribute__ ((naked)) __attribute__ ((section (".vectors")));
+void __vectors      (void) __attribute__ ((naked)) __attribute__ ((section (".vectors")));
+void __Init         (void) __attribute__ ((naked)) __attribute__ ((section (".init0")));
 void __do_copy_data (void) __attribute__ ((naked)) __attribute__ ((section (".init4")));
 void __jumpMain     (void) __attribute__ ((naked)) __attribute__ ((section (".init9")));
 
+#define STR(x)  #x
+#define XSTR(x) STR(x)
+
+#if TIMER1_COMPA_vect_num >= SPI_STC_vect_num || SPI_STC_vect_num >= USART1_RX_vect_num
+#error "Vector table below assumes TIMER1_COMPA, SPI_STC, USART1_RX in that order"
+#endif
+
+// Only an SPI build has an SPI interrupt handler.
+#if TRANSPORT == TRANSPORT_SPI
+#define SPI_VECTOR XSTR(SPI_STC_vect)
+#else
+#define SPI_VECTOR "__Init"
+#endif
+
+/*
+ * Interrupt vector table. main() moves the vectors to the boot section
+ * (IVSEL) so UART1_sleep() and SPI_sleep() can be woken by the UART1
+ * receive, SPI transfer and Timer1 compare interrupts; no other interrupt is
+ * ever enabled, so every other vector just restarts the bootloader.
+ */
+void __vectors(void)
+{
+    __asm__ __volatile__
+    (
+        "jmp __Init                         \n\t"
+        ".rept %0                           \n\t"
+        "jmp __Init                         \n\t"
+        ".endr                              \n\t"
+        "jmp " XSTR(TIMER1_COMPA_vect) "    \n\t"
+        ".rept %1                           \n\t"
+        "jmp __Init                         \n\t"
+        ".endr                              \n\t"
+        "jmp " SPI_VECTOR "                 \n\t"
+        ".rept %2                           \n\t"
+        "jmp __Init                         \n\t"
+        ".endr                              \n\t"
+        "jmp " XSTR(USART1_RX_vect) "       \n\t"
+        ".rept %3                           \n\t"
+        "jmp __Init                         \n\t"
+        ".endr                              \n\t"
+        :
+        : "M" (TIMER1_COMPA_vect_num - 1),
+          "M" (SPI_STC_vect_num - TIMER1_COMPA_vect_num - 1),
+          "M" (USART1_RX_vect_num - SPI_STC_vect_num - 1),
+          "M" (_VECTORS_SIZE / 4 - USART1_RX_vect_num - 1)
+    );
+}
+
 void __Init(void)
 {
 #if 0
@@ -3,8 +3,35 @@
  */
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
 #include "uart.h"
 
+// Timer1 values at the start of the current frame and at the last byte.
+static uint16_t frame_start;
+static uint16_t byte_start;
+
+/* init Timer1
+ * Free running from F_CPU / 1024, used for the receive deadlines.
+ */
+void UART_timer_init(void)
+{
+    TCCR1A = 0;
+    TCCR1B = (1 << CS12) | (1 << CS10);
+}
+
+
+/* Wake-up interrupts for UART1_sleep(). Each one turns both sources off
+ * again: the receive interrupt would otherwise keep firing until UDR1 is read.
+ */
+ISR(USART1_RX_vect)
+{
+    UCSR1B &= ~(1 << RXCIE1);
+    TIMSK1 &= ~(1 << OCIE1A);
+}
+
+ISR(TIMER1_COMPA_vect, ISR_ALIASOF(USART1_RX_vect));
+
 
 /* init UART1
  * BAUD must be set and setbaud imported before calling this
@@ -47,10 +74,33 @@ unsigned char UART1_getchar(void)
     {
         /* Wait for data to be received */
     }
-    /* Get and return received data from buffer */
+    /* Restart the byte deadline, get and return received data from buffer */
+    byte_start = TCNT1;
     return UDR1;
 }
 
+/* Idle-sleep until UART1 receives a byte, or for at most UART1_WAKE_MS so
+ * callers can check their deadlines and service the watchdog. Returns
+ * straight away if a byte is already waiting.
+ */
+void UART1_sleep(void)
+{
+    cli();
+    OCR1A = TCNT1 + UART_TIMER_TICKS(UART1_WAKE_MS);
+    TIFR1 = (1 << OCF1A);
+    TIMSK1 |= (1 << OCIE1A);
+    UCSR1B |= (1 << RXCIE1);
+
+    // sei() takes effect after the next instruction, so a byte that arrived
+    // before it wakes the sleep rather than being missed.
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_enable();
+    sei();
+    sleep_cpu();
+    sleep_disable();
+    cli();
+}
+
 void UART1_flush(void)
 {
     // Tell the compiler that this variable is not being used
@@ -68,6 +118,53 @@ void UART1_putstring(char* str)
     UART1_putchar((unsigned char)0);  // make sure we send out the null terminator
 }
 
+/* Start timing a frame: restarts both the frame and the byte deadline. */
+void UART1_timeout_begin(void)
+{
+    frame_start = TCNT1;
+    byte_start = frame_start;
+}
+
+/* True once the frame deadline or the byte deadline has passed. */
+bool UART1_timeout_expired(void)
+{
+    uint16_t now = TCNT1;
+
+    return (uint16_t)(now - frame_start) > UART_TIMER_TICKS(UART1_FRAME_TIMEOUT_MS) ||
+           (uint16_t)(now - byte_start) > UART_TIMER_TICKS(UART1_BYTE_TIMEOUT_MS);
+}
+
+/* Restart only the byte deadline, for other transports' receivers. */
+void UART_timer_byte(void)
+{
+    byte_start = TCNT1;
+}
+
+/* True once the byte deadline alone has passed. */
+bool UART_timer_byte_expired(void)
+{
+    return (uint16_t)(TCNT1 - byte_start) > UART_TIMER_TICKS(UART1_BYTE_TIMEOUT_MS);
+}
+
+/* Discard input until the line has been quiet for a byte timeout, so the
+ * next byte received is the start of a new frame.
+ */
+void UART1_resync(void)
+{
+    UART_timer_byte();
+    while (!UART_timer_byte_expired())
+    {
+        if (UART1_data_available())
+        {
+            UART1_getchar();
+        }
+        else
+        {
+            UART1_sleep();
+        }
+    }
+}
+
 
 /* init UART0
  * BAUD must be set and setbaud imported before calling this
@@ -110,10 +207,27 @@ unsigned char UART0_getchar(void)
     {
         /* Wait for data to be received */
     }
-    /* Get and return received data from buffer */
+    /* Restart the byte deadline (UART0 carries half of a striped frame), get
+     * and return received data from buffer */
+    byte_start = TCNT1;
     return UDR0;
 }
 
+/* Discard input until UART0 has been quiet for a byte timeout. UART0 cannot
+ * wake UART1_sleep(), so this polls.
+ */
+void UART0_resync(void)
+{
+    byte_start = TCNT1;
+    while ((uint16_t)(TCNT1 - byte_start) <= UART_TIMER_TICKS(UART1_BYTE_TIMEOUT_MS))
+    {
+        if (UART0_data_available())
+        {
+            UART0_getchar();
+        }
+    }
+}
+
 void UART0_flush(void)
 {
     // Tell the compiler that this variable is not being used
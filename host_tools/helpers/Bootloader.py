@@ -0,0 +1,458 @@
+#!/usr/bin/env python
+
+"""
+Speaks the bootloader's update and readback protocols over a serial port.
+Shared by the one-shot host tools and by Session.
+
+Given a second port wired to a STRIPED bootloader's UART0, update page frames
+and readback pages are split across both ports: the first half of the data
+on the main port, the second half on the second port at the same time. This
+is used only once the bootloader has announced its mode on both ports.
+"""
+
+import struct
+import threading
+import time
+
+from math import ceil
+from Crypt import PAGE_SIZE, TAG_LABEL_REQUEST
+from Trace import KIND_FRAME, KIND_PAGE, KIND_TIMEOUT
+from Transport import Transport, SerialTransport
+
+RESP_OK = b'\x00'
+RESP_ERROR = b'\x01'
+RESP_NAK = b'\x02'
+
+# Times a frame is sent again after the bootloader NAKs it or does not answer.
+MAX_RETRIES = 3
+
+# Seconds allowed on top of a frame's transmission time for the bootloader to
+# process it, or to time it out (UART1_FRAME_TIMEOUT_MS) and NAK it, plus the
+# time allowed for decrypting and programming each page in the frame.
+RESPONSE_SLACK = 0.5
+PAGE_COMMIT_TIME = 0.05
+
+# Time allowed for each page the bootloader may have to erase before it can
+# program a frame's pages, when the frame jumps ahead of its background erase
+# (see program_flash()).
+PAGE_ERASE_TIME = 0.005
+
+RB_FLAG_ELIDE_ERASED = 0x00000001
+RB_FLAG_DIGEST = 0x00000002
+RB_FLAG_STRIPED = 0x00000004
+
+# Set in the length of a frame whose data section is striped.
+FRAME_STRIPED = 0x8000
+
+DIGEST_SIZE = 16
+
+RECORD_PAGE = 'P'
+RECORD_ERASED = 'E'
+
+def _crcTable():
+    table = []
+    for i in range(256):
+        crc = i
+        for bit in range(8):
+            crc = (crc >> 1) ^ 0x8408 if crc & 1 else crc >> 1
+        table.append(crc)
+    return table
+
+CRC_TABLE = _crcTable()
+
+def crc16(data, crc=0xFFFF):
+    """
+    CRC-16/CCITT of data as the bootloader computes it (avr-libc's
+    _crc_ccitt_update(), starting from 0xFFFF).
+    """
+    for c in data:
+        crc = (crc >> 8) ^ CRC_TABLE[(crc ^ ord(c)) & 0xFF]
+    return crc
+
+def transport(port):
+    return port if isinstance(port, Transport) else SerialTransport(port)
+
+class Bootloader:
+
+    def __init__(self, ser, debug=False, trace=None, ser2=None):
+        # ser is a Transport, or a pyserial port for the UART transport.
+        self.ser = transport(ser)
+        self.debug = debug
+        # A Trace to record frame timings in, if any.
+        self.trace = trace
+
+        # Port wired to the bootloader's UART0, if any, and whether the
+        # bootloader announced itself on it too (see waitFor()).
+        self.ser2 = transport(ser2) if ser2 is not None else None
+        self.striped = False
+
+        # Sequence number of the next frame; each operation starts from 0.
+        self.seq = 0
+
+        # Frames written (counting every attempt), and how many of those
+        # were NAKed or got no answer at all.
+        self.framesSent = 0
+        self.naks = 0
+        self.unanswered = 0
+
+    def waitFor(self, banner):
+        """
+        Wait for the bootloader to announce a mode (or echo a command).
+        """
+        while self.ser.read(1) != banner:
+            pass
+
+        if self.ser2 is not None:
+            self.striped = self.__waitFor2(banner)
+            if not self.striped:
+                print("No banner on the second port, not striping.")
+
+    def __waitFor2(self, banner):
+        """
+        True if the banner also arrives on ser2 within RESPONSE_SLACK.
+        """
+        timeout = self.ser2.timeout
+        self.ser2.timeout = RESPONSE_SLACK
+        try:
+            while True:
+                c = self.ser2.read(1)
+                if c == banner:
+                    return True
+                if c == '':
+                    return False
+        finally:
+            self.ser2.timeout = timeout
+
+    def expectOK(self, count=1):
+        for i in range(count):
+            self.checkOK(self.ser.read())
+
+    def checkOK(self, resp):
+        if resp != RESP_OK:
+            raise RuntimeError("ERROR: Bootloader responded with {}".format(repr(resp)))
+
+    def frame(self, data, flags=0):
+        """
+        Wrap data in a frame: its length (with flags), the sequence number and
+        a CRC of both and the data.
+        """
+        frame = struct.pack('>HB', len(data) | flags, self.seq) + data
+        return frame + struct.pack('>H', crc16(frame))
+
+    def sendFrame(self, data, pages=0, prefix='', stripe=False, erases=0):
+        """
+        Send data as the next frame (after prefix, if any) and return the
+        bootloader's response. Only this frame is sent again, up to
+        MAX_RETRIES times, when the bootloader NAKs it (naming it as the frame
+        it expects) or does not answer. The read timeout is set from the
+        frame's transmission time, the number of pages it carries and the
+        number of pages that may need erasing first rather than a fixed value.
+
+        With stripe, the data section is split across both ports if the
+        bootloader is striping.
+        """
+        if stripe and self.striped:
+            half = (len(data) + 1) // 2
+            frame = self.frame(data, FRAME_STRIPED)
+            frame, second = prefix + frame[:3 + half] + frame[-2:], data[half:]
+        else:
+            frame, second = prefix + self.frame(data), ''
+
+        timeout = self.ser.timeout
+        self.ser.timeout = (self.ser.transmitTime(len(frame)) + pages * PAGE_COMMIT_TIME +
+                            erases * PAGE_ERASE_TIME + RESPONSE_SLACK)
+
+        try:
+            for attempt in range(MAX_RETRIES + 1):
+                if self.trace:
+                    t0 = self.trace.now()
+                    self.__write(frame, second)
+                    self.ser.flush()
+                    t1 = self.trace.now()
+                    resp = self.ser.read()
+                    self.trace.add(KIND_FRAME if resp else KIND_TIMEOUT,
+                                   len(frame) + len(second), t0, t1,
+                                   self.trace.now(), resp)
+                else:
+                    self.__write(frame, second)
+                    resp = self.ser.read()
+                self.framesSent += 1
+
+                if resp == RESP_NAK:
+                    named = self.ser.read()
+                    if named != chr(self.seq):
+                        raise RuntimeError("ERROR: Bootloader NAKed frame {} while frame {} was sent".format(
+                            repr(named), self.seq))
+                    self.naks += 1
+                    if self.debug:
+                        print("Frame {} damaged or timed out, resending...".format(self.seq))
+                    continue
+
+                # A bootloader that did get the frame acknowledges it again.
+                if resp == '':
+                    self.unanswered += 1
+                    if self.debug:
+                        print("No answer to frame {}, resending...".format(self.seq))
+                    continue
+
+                if resp == RESP_OK:
+                    self.seq = (self.seq + 1) % 256
+                return resp
+        finally:
+            self.ser.timeout = timeout
+
+        raise RuntimeError("ERROR: Frame {} failed {} times".format(self.seq, MAX_RETRIES + 1))
+
+    def __write(self, frame, second):
+        """
+        Write frame to ser and, at the same time, second to ser2.
+        """
+        if not second:
+            self.ser.write(frame)
+            return
+
+        writer = threading.Thread(target=self.ser2.write, args=(second,))
+        writer.start()
+        self.ser.write(frame)
+        writer.join()
+        self.ser2.flush()
+
+    def errorReport(self):
+        """
+        Summary of frames resent over the bootloader's lifetime.
+        """
+        resent = self.naks + self.unanswered
+        rate = 100.0 * resent / self.framesSent if self.framesSent else 0
+        return "{} frames sent, {} NAKed, {} unanswered ({:.1f}% resent)".format(
+            self.framesSent, self.naks, self.unanswered, rate)
+
+    def sendFirmware(self, firmware, frame_pages=None):
+        """
+        Send a protected firmware file. The bootloader must already be
+        waiting for the header frame. Pages are grouped frame_pages to a frame
+        (by default as many as the firmware file asks for), capped at what the
+        bootloader reports it can buffer. Returns the frame size used.
+        """
+        fw_Metadata = firmware.getMetadata()
+        self.seq = 0
+
+        max_pages = self.sendHeader(firmware)
+        frame_pages = min(frame_pages or fw_Metadata['frame_pages'], max_pages)
+
+        if self.debug:
+            print("Sending {} page(s) per frame (bootloader allows {})".format(frame_pages, max_pages))
+
+        self.sendPages(firmware, frame_pages, stripe=True)
+
+        # Send a zero length payload to tell the bootlader to finish writing
+        # it's page.
+        self.checkOK(self.sendFrame(''))
+
+        return frame_pages
+
+    def sendHeader(self, firmware, prefix=''):
+        """
+        Send the firmware file's header as the next frame (after prefix, if
+        any). Returns the number of pages the bootloader can take per frame.
+        """
+        fw_Metadata = firmware.getMetadata()
+
+        # Send header to the bootloader
+        metadata = fw_Metadata['iv'] + fw_Metadata['header']
+
+        if self.debug:
+            print(fw_Metadata['iv'].encode('hex'))
+            print(metadata.encode('hex'))
+
+        # Wait for an OK from the bootloader.
+        self.checkOK(self.sendFrame(metadata, prefix=prefix))
+        self.expectOK(2)
+
+        # The bootloader then reports how many pages fit in one frame.
+        max_pages = self.ser.read(1)
+        if max_pages == '':
+            raise RuntimeError("ERROR: Bootloader did not report its frame size")
+        return ord(max_pages)
+
+    def sendPages(self, pages, frame_pages, prefix='', stripe=False):
+        """
+        Send pages (a firmware file or a list of its pages) frame_pages to a
+        frame, each frame after prefix, if any.
+        """
+        # Pages below erased are known to be erased by now: the bootloader
+        # erases in order and catches up with each page it programs.
+        count = 1
+        erased = 0
+        for group in self.groupPages(pages, frame_pages):
+            if self.debug:
+                print("Writing frame {} ({} pages)...".format(count, len(group)))
+            count += 1
+
+            body = ''.join(self.pageUnit(page) for page in group)
+
+            if self.debug:
+                print(body.encode('hex'))
+
+            top = max(page['page'] for page in group) + 1
+            erases = max(0, top - erased)
+            erased = max(erased, top)
+
+            # Write the frame and wait for an OK
+            resp = self.sendFrame(body, len(group), prefix, stripe, erases)
+
+            if resp != RESP_OK:
+                raise RuntimeError("ERROR: Bootloader responded with {}".format(repr(resp)))
+
+            if self.debug:
+                print("Resp: {}".format(ord(resp)))
+
+    def pageUnit(self, page):
+        """
+        A page as it is sent in an update frame.
+        """
+        return struct.pack('>H', page['page']) + page['iv'] + page['msg'] + page['tag']
+
+    def groupPages(self, pages, size):
+        """
+        Yield pages (a firmware file or a list of its pages) in lists of up
+        to size pages.
+        """
+        batch = []
+        for page in pages:
+            batch.append(page)
+            if len(batch) == size:
+                yield batch
+                batch = []
+
+        if batch:
+            yield batch
+
+    def readMemory(self, crypt, start_addr, num_bytes, flags=0):
+        """
+        Send a readback request and return the decrypted bytes. The
+        bootloader must already be waiting for the request frame.
+        """
+        return ''.join(self.iterMemory(crypt, start_addr, num_bytes, flags))
+
+    def streamMemory(self, crypt, start_addr, num_bytes, outfile, flags=0,
+                     progress=None):
+        """
+        Send a readback request and write each page to outfile as soon as
+        it is decrypted. progress, if given, is called after every page with
+        the bytes written so far and the seconds elapsed.
+        """
+        written = 0
+        start = time.time()
+
+        for data in self.iterMemory(crypt, start_addr, num_bytes, flags):
+            outfile.write(data)
+            outfile.flush()
+            written += len(data)
+
+            if progress:
+                progress(written, time.time() - start)
+
+        return written
+
+    def iterMemory(self, crypt, start_addr, num_bytes, flags=0):
+        """
+        Send a readback request and yield the decrypted data one page at a
+        time, trimmed to num_bytes in total.
+        """
+        self.seq = 0
+        if self.striped:
+            flags |= RB_FLAG_STRIPED
+        self.checkOK(self.sendFrame(self.__constructRequest(crypt, start_addr, num_bytes, flags)))
+        self.expectOK()
+
+        numFrames = int(ceil(num_bytes / float(PAGE_SIZE)))
+
+        if flags & RB_FLAG_ELIDE_ERASED:
+            pages = self.__readRecords(crypt, numFrames)
+        else:
+            pages = (self.__readPage(crypt) for i in range(numFrames))
+
+        remaining = num_bytes
+        for page in pages:
+            yield page[:remaining]
+            remaining -= len(page)
+
+    def diffMemory(self, crypt, start_addr, image):
+        """
+        Send a digest readback request covering image, which is expected at
+        start_addr, and return the addresses of the pages whose digests do not
+        match it. A short last page is compared as if padded with erased
+        bytes.
+        """
+        seed = struct.unpack(">I", crypt.getRandomBytes(4))[0]
+        self.seq = 0
+        self.checkOK(self.sendFrame(self.__constructRequest(crypt, start_addr, len(image),
+                                                            RB_FLAG_DIGEST, seed)))
+        self.expectOK()
+
+        differ = []
+        for offset in range(0, len(image), PAGE_SIZE):
+            digest = self.ser.read(DIGEST_SIZE)
+            if len(digest) != DIGEST_SIZE:
+                raise RuntimeError("ERROR: Timed out waiting for readback digests.")
+
+            page = image[offset:offset + PAGE_SIZE].ljust(PAGE_SIZE, '\xff')
+            if crypt.pageDigest(page, start_addr + offset, seed) != digest:
+                differ.append(start_addr + offset)
+
+        return differ
+
+    def __constructRequest(self, crypt, start_addr, num_bytes, flags, seed=None):
+        nonce = struct.unpack(">I", crypt.getNonce())[0]
+        if seed is None:
+            seed = struct.unpack(">I", crypt.getRandomBytes(4))[0]
+        if flags:
+            header = struct.pack('>IIIII', nonce, start_addr, num_bytes, seed, flags)
+        else:
+            header = struct.pack('>IIII', nonce, start_addr, num_bytes, seed)
+        header_enc, iv = crypt.encode(header)
+        header_enc += crypt.tag(TAG_LABEL_REQUEST, iv, header_enc)
+
+        return iv + header_enc
+
+    def __readPage(self, crypt):
+        # A striped page's second half arrives on ser2 alongside the first.
+        first = 16 + (PAGE_SIZE // 2 if self.striped else PAGE_SIZE)
+
+        if self.trace:
+            t0 = self.trace.now()
+            data = self.ser.read(1)
+            t1 = self.trace.now()
+            data += self.ser.read(first - len(data))
+        else:
+            data = self.ser.read(first)
+        if self.striped and len(data) == first:
+            data += self.ser2.read(PAGE_SIZE // 2)
+        if self.trace:
+            self.trace.add(KIND_PAGE, len(data), t0, t1, self.trace.now())
+
+        if len(data) != 16 + PAGE_SIZE:
+            raise RuntimeError("ERROR: Timed out waiting for readback data.")
+
+        iv = data[0:16]
+        data = data[16:]
+
+        return crypt.decode(data, iv)
+
+    def __readRecords(self, crypt, numFrames):
+        """
+        Read an erased-elided response and expand it back into whole pages.
+        """
+        count = 0
+        while count < numFrames:
+            tag = self.ser.read(1)
+            if tag == RECORD_PAGE:
+                count += 1
+                yield self.__readPage(crypt)
+            elif tag == RECORD_ERASED:
+                run = struct.unpack('>H', self.ser.read(2))[0]
+                count += run
+                for i in range(run):
+                    yield '\xff' * PAGE_SIZE
+            else:
+                raise RuntimeError("ERROR: Unexpected readback record {}".format(repr(tag)))
@@ -0,0 +1,170 @@
+#!/usr/bin/env python
+
+"""
+Drives a broadcast update of every bootloader on a shared bus. The devices
+must all be in a session (both jumpers in place).
+"""
+
+import time
+
+from Bootloader import Bootloader, MAX_RETRIES, RESPONSE_SLACK
+
+# Session command asking one device, by bus ID, for its frame limit.
+BUS_CMD_LIMIT = 'L'
+
+# Repair phase commands, each followed by a bus ID.
+BUS_CMD_QUERY = 'Q'
+BUS_CMD_HEADER = 'H'
+BUS_CMD_FRAME = 'F'
+BUS_CMD_BOOT = 'B'
+BUS_ALL = 0xFF
+
+# Pages below the bootloader section (APP_PAGES in bootloader.c), and the
+# size of the bitmap of written pages a device sends back.
+APP_PAGES = 0x1E000 // 256
+BITMAP_SIZE = APP_PAGES // 8
+
+# What a device spends on each page once a frame is in (commit_pages() in
+# bootloader.c), from the same datasheet and estimated figures for an
+# ATmega1284P at 20 MHz as transport_sim: a CBC page is decrypted and its MAC
+# computed, then erased if the background erase has not reached it yet, and
+# programmed. CTR pages are decrypted as they arrive, but the payload mode is
+# in the encrypted header, so the pause allows for CBC.
+AES_BLOCK_US = 500
+PAGE_WRITE_MS = 4.5
+PAGE_COMMIT_BLOCKS = 33
+
+# A device that lost bytes of a frame waits UART1_BYTE_TIMEOUT_MS for them,
+# then as long again for the line to go quiet (transport_resync()), and
+# throws away anything that arrives meanwhile. Twice that is allowed, for the
+# device's timer and the host's sleep.
+FRAME_RESYNC_TIME = 4 * 0.02
+
+# A device that accepts the header writes the version and size to EEPROM, six
+# bytes at the datasheet's 3.3 ms each, before it reads the next frame.
+HEADER_TIME = 6 * 3.3e-3
+
+def pageCommitTime(aes_block_us=AES_BLOCK_US, page_write_ms=PAGE_WRITE_MS):
+    """
+    Seconds a device takes to commit one page of a broadcast frame: its AES
+    blocks, an erase and the programming.
+    """
+    return PAGE_COMMIT_BLOCKS * aes_block_us * 1e-6 + 2 * page_write_ms * 1e-3
+
+class Bus(Bootloader):
+
+    def broadcast(self, firmware, ids, frame_pages=None, page_time=None):
+        """
+        Stream the firmware to every device at once. The devices in ids are
+        first asked how many pages they can take per frame, and frames are
+        capped at the smallest. Nothing is read back; each frame is followed
+        by a pause long enough for the devices to commit its pages, page_time
+        seconds each (pageCommitTime() if not given), or for a device that
+        lost some of it to resync before the next. Returns the frame size
+        used.
+        """
+        fw_Metadata = firmware.getMetadata()
+        page_time = page_time or pageCommitTime()
+
+        # Anything the devices said (their session banners, which may still
+        # be arriving) is stale now.
+        time.sleep(RESPONSE_SLACK)
+        self.ser.flushInput()
+        limits = [self.frameLimit(bus_id) for bus_id in ids]
+        frame_pages = min([frame_pages or fw_Metadata['frame_pages']] + limits)
+
+        if self.debug:
+            print("Broadcasting {} page(s) per frame (devices allow {})".format(frame_pages, limits))
+
+        # Start the broadcast update and send the header. Devices answer
+        # nothing, so allow for the header's processing, or for a device that
+        # lost some of it to resync. The first frame must follow within the
+        # devices' watchdog period. Devices do not check sequence numbers in a
+        # broadcast update.
+        self.seq = 0
+        self.ser.write('M')
+        self.ser.write(self.frame(fw_Metadata['iv'] + fw_Metadata['header']))
+        self.ser.flush()
+        time.sleep(max(HEADER_TIME, FRAME_RESYNC_TIME))
+
+        for pages in self.groupPages(firmware, frame_pages):
+            body = ''.join(self.pageUnit(page) for page in pages)
+            self.ser.write(self.frame(body))
+            self.ser.flush()
+            time.sleep(max(len(pages) * page_time, FRAME_RESYNC_TIME))
+
+        self.ser.write(self.frame(''))
+        self.ser.flush()
+        time.sleep(RESPONSE_SLACK)
+
+        return frame_pages
+
+    def frameLimit(self, bus_id):
+        """
+        Return the number of pages the device can take per frame. Nothing
+        else may be talking on the bus.
+        """
+        self.command(BUS_CMD_LIMIT, bus_id)
+        limit = self.ser.read()
+        if limit == '':
+            raise RuntimeError("ERROR: Device {} did not answer".format(bus_id))
+        return ord(limit)
+
+    def command(self, cmd, bus_id):
+        """
+        Send a command to one device and check that it answers OK. The
+        command is sent again, up to MAX_RETRIES times, if the device does
+        not answer: it may have lost the command while discarding a frame
+        for another device.
+        """
+        for attempt in range(MAX_RETRIES + 1):
+            self.ser.write(cmd + chr(bus_id))
+            resp = self.ser.read()
+            if resp != '':
+                break
+            self.unanswered += 1
+            if self.debug:
+                print("No answer from device {}, sending {} again...".format(bus_id, cmd))
+
+        self.checkOK(resp)
+
+    def missing(self, bus_id, firmware):
+        """
+        Return the number of pages the device can take per frame, 0 if it
+        missed the header, and the firmware's pages it has not written.
+        """
+        self.command(BUS_CMD_QUERY, bus_id)
+        answer = self.ser.read(1 + BITMAP_SIZE)
+        if len(answer) != 1 + BITMAP_SIZE:
+            raise RuntimeError("ERROR: Device {} did not answer".format(bus_id))
+
+        limit, bitmap = ord(answer[0]), answer[1:]
+        return limit, [page for page in firmware
+                       if not ord(bitmap[page['page'] // 8]) & (1 << (page['page'] % 8))]
+
+    def repair(self, bus_id, firmware, frame_pages):
+        """
+        Unicast the pages the device missed, after the header if it missed
+        that too. Returns how many pages were sent.
+        """
+        # The query restarts the device's frame numbers.
+        self.seq = 0
+        limit, pages = self.missing(bus_id, firmware)
+        if limit == 0:
+            if self.debug:
+                print("Device {} missed the header, sending it again...".format(bus_id))
+            limit = self.sendHeader(firmware, BUS_CMD_HEADER + chr(bus_id))
+
+        self.sendPages(pages, min(frame_pages, limit), BUS_CMD_FRAME + chr(bus_id))
+
+        return len(pages)
+
+    def boot(self, bus_id=BUS_ALL):
+        """
+        Finish the update and boot one device, or all of them. Only a device
+        booted alone answers, so only then is the command known to arrive.
+        """
+        if bus_id != BUS_ALL:
+            self.command(BUS_CMD_BOOT, bus_id)
+        else:
+            self.ser.write(BUS_CMD_BOOT + chr(bus_id))
@@ -5,12 +5,71 @@ Deals with storage and generation of AES keys and nonce
 for both factory and bootloader
 """
 
+import struct
+
 from SecretFile import SecretFile
 from Crypto.Cipher import AES
+from Crypto.Util import Counter
 from Crypto.Random import get_random_bytes
 
 PAGE_SIZE  = 256
 
+# First byte of the block the MAC key is derived from. The device never sees
+# it: bl_build derives the MAC key and expands it into MAC_KEY_SCHEDULE in
+# keys.h.
+MAC_KEY_LABEL = 'K'
+
+# First byte of the first block of a readback page digest (DIGEST_LABEL in
+# bootloader.c).
+DIGEST_LABEL = 'D'
+
+# First bytes of the first block of a tag (TAG_LABEL_* in bootloader.c).
+TAG_LABEL_HEADER = 'H'
+TAG_LABEL_REQUEST = 'Q'
+TAG_LABEL_PAGE = 'P'
+
+# Size of an AES-128 key schedule: the key and ten round keys.
+KEY_SCHEDULE_SIZE = 176
+
+def _sbox():
+    """
+    The AES S-box: the inverse in GF(2^8) of each byte, put through the
+    affine transform.
+    """
+    rot = lambda x, n: ((x << n) | (x >> (8 - n))) & 0xFF
+    box = [0x63] * 256
+    p = q = 1
+    while True:
+        # p runs through the multiplicative group (times 3), q through the
+        # inverses (divided by 3).
+        p = p ^ ((p << 1) & 0xFF) ^ (0x1B if p & 0x80 else 0)
+        q ^= q << 1
+        q ^= q << 2
+        q ^= q << 4
+        q &= 0xFF
+        if q & 0x80:
+            q ^= 0x09
+        box[p] = q ^ rot(q, 1) ^ rot(q, 2) ^ rot(q, 3) ^ rot(q, 4) ^ 0x63
+        if p == 1:
+            return box
+
+def expandKey(key):
+    """
+    Expand a 16-byte AES key into the 176-byte schedule the bootloader uses
+    (KeyExpansion in tiny-AES). Decryption applies the same round keys in
+    reverse, so there is no separate decryption schedule.
+    """
+    sbox = _sbox()
+    w = [ord(c) for c in key]
+    rcon = 1
+    for i in range(16, KEY_SCHEDULE_SIZE, 4):
+        t = w[i - 4:i]
+        if i % 16 == 0:
+            t = [sbox[t[1]] ^ rcon, sbox[t[2]], sbox[t[3]], sbox[t[0]]]
+            rcon = ((rcon << 1) ^ (0x1B if rcon & 0x80 else 0)) & 0xFF
+        w += [w[i - 16 + j] ^ t[j] for j in range(4)]
+    return ''.join(chr(b) for b in w)
+
 class Crypt:
 
     def __init__(self, directory):
@@ -45,6 +104,50 @@ class Crypt:
         msg = self.randomPadToSize(msg, size=16)
         return (cipher.encrypt(msg), cipher.iv)
 
+    def encodeCTR(self, msg):
+        """
+        Encrypt msg in counter mode. The returned IV is the first counter
+        block; the bootloader increments it as a 128-bit big-endian integer.
+        """
+        key = self.getAESKey()
+        iv = self.getRandomBytes(16)
+        ctr = Counter.new(128, initial_value=int(iv.encode('hex'), 16))
+        cipher = AES.new(key, AES.MODE_CTR, counter=ctr)
+        return (cipher.encrypt(msg), iv)
+
+    def getMACKey(self):
+        """
+        Key for MACs, derived from the AES key. bl_build expands it into
+        MAC_KEY_SCHEDULE in keys.h, so the bootloader only holds its round
+        keys.
+        """
+        cipher = AES.new(self.getAESKey(), AES.MODE_ECB)
+        return cipher.encrypt(MAC_KEY_LABEL.ljust(16, '\0'))
+
+    def mac(self, msg):
+        """
+        CBC-MAC of msg (a multiple of 16 bytes) under the MAC key.
+        """
+        cipher = AES.new(self.getMACKey(), AES.MODE_CBC, iv='\0' * 16)
+        return cipher.encrypt(msg)[-16:]
+
+    def pageDigest(self, page, addr, seed):
+        """
+        Digest the bootloader sends for a page read from addr in response to
+        a digest readback request made with seed.
+        """
+        block = (DIGEST_LABEL + struct.pack('>II', addr, seed)).ljust(16, '\0')
+        return self.mac(block + page)
+
+    def tag(self, label, iv, ciphertext, ident=0, extra=0):
+        """
+        Tag the bootloader checks for an encrypted header, request or page:
+        the MAC of a block holding label, the ciphertext's length, ident and
+        extra, followed by the IV and the ciphertext.
+        """
+        block = (label + struct.pack('>HHH', len(ciphertext), ident, extra)).ljust(16, '\0')
+        return self.mac(block + iv + ciphertext)
+
     def decode(self, msg, iv_val):
         key = self.getAESKey()
         cipher = AES.new(key, AES.MODE_CBC, iv=iv_val)
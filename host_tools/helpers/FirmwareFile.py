@@ -10,17 +10,33 @@ class FirmwareFile:
 	def __init__(self, firmwareFileName):
 		self.firmwareFileName = firmwareFileName
 		self.curFileName = ['a']
+		self.zf = None
+
+	def __enter__(self):
+		# Keep the archive open while it is written rather than reopening
+		# it (and rereading its directory) for every page.
+		self.zf = ZipFile(self.firmwareFileName, 'a')
+		return self
+
+	def __exit__(self, *exc):
+		self.zf.close()
+		self.zf = None
 
 	def __iter__(self):
 		with ZipFile(self.firmwareFileName, 'r') as zf:
 			fileList = zf.namelist()
 			fileList.sort(key=lambda item: (len(item), item))
 
+			page = 0
 			for filename in fileList:
 				if filename != self.METADATA_FILENAME:
 					data = json.loads(zf.read(filename))
 					data['msg'] = data['msg'].decode('hex')
 					data['iv'] = data['iv'].decode('hex')
+					data['tag'] = data['tag'].decode('hex')
+					# Files without page numbers hold consecutive pages from 0.
+					data.setdefault('page', page)
+					page = data['page'] + 1
 					yield data
 
 	def __len__(self):
@@ -44,22 +60,26 @@ class FirmwareFile:
                 print metadata
 		metadata['header'] = metadata['header'].decode('hex')
 		metadata['iv'] = metadata['iv'].decode('hex')
+		metadata.setdefault('frame_pages', 1)
 		return metadata
 
-	def writeMetadata(self, header, version, size, iv):
+	def writeMetadata(self, header, version, size, iv, frame_pages=1):
 		data = {
-        	'header'   : header.encode('hex'),
-        	'version'  : version,
-        	'size'     : size,
-        	'iv'       : iv.encode('hex')
-    	}
-    	
+			'header'      : header.encode('hex'),
+			'version'     : version,
+			'size'        : size,
+			'iv'          : iv.encode('hex'),
+			'frame_pages' : frame_pages
+		}
+
 		self.__writeData(self.METADATA_FILENAME, data)
 
-	def writePage(self, msg, iv):
+	def writePage(self, msg, iv, page, tag):
 		data = {
-			'msg' : msg.encode('hex'),
-			'iv'  : iv.encode('hex')
+			'msg'  : msg.encode('hex'),
+			'iv'   : iv.encode('hex'),
+			'page' : page,
+			'tag'  : tag.encode('hex')
 		}
 		filename = ''.join(self.curFileName)
 		self.__writeData(filename, data)
@@ -69,6 +89,10 @@ class FirmwareFile:
 	def __writeData(self, fileName, data):
 		data = json.dumps(data, encoding="ascii")
 
+		if self.zf:
+			self.zf.writestr(fileName, data)
+			return
+
 		with ZipFile(self.firmwareFileName, 'a') as zf:
 			zf.writestr(fileName, data)
 
@@ -0,0 +1,100 @@
+#!/usr/bin/env python
+
+"""
+Native builds of the bootloader (make native, see bootloader/src/hal_linux.c)
+standing in for boards in the tests, and the images to update them with.
+include/keys.h and secret_build_output.txt must be from the same bl_build
+run.
+"""
+
+import os
+import random
+import subprocess
+import sys
+import time
+
+from intelhex import IntelHex
+from Bootloader import RESPONSE_SLACK
+
+FILE_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+BOOTLOADER_DIR = os.path.join(os.path.dirname(FILE_DIR), 'bootloader')
+
+# Exit status of a native bootloader that jumped to the application.
+HAL_EXIT_BOOT = 0
+
+class Board:
+    """
+    A native bootloader started on a new pseudo-terminal, with its flash and
+    EEPROM kept in workdir. mode gives the jumpers fitted (BL_MODE: both, a
+    session, by default), and env any more settings.
+    """
+    def __init__(self, program, workdir, mode='S', env=None):
+        self.flash = os.path.join(workdir, os.path.basename(program) + '.flash')
+        env = dict(os.environ, BL_MODE=mode, BL_UART1='pty', BL_FLASH=self.flash,
+                   BL_EEPROM=os.path.join(workdir, os.path.basename(program) + '.eeprom'),
+                   BL_UART0=os.devnull, **(env or {}))
+        with open(os.devnull, 'w') as devnull:
+            self.process = subprocess.Popen([program], env=env, stdout=devnull,
+                                            stderr=subprocess.PIPE)
+        self.port = self.process.stderr.readline().split()[-1]
+
+    def kill(self):
+        if self.process.poll() is None:
+            self.process.kill()
+            self.process.wait()
+
+    def finish(self, image):
+        """
+        Wait for the board to end, for up to RESPONSE_SLACK seconds once its
+        port is closed, then end it. True if it booted with image at the
+        start of flash.
+        """
+        deadline = time.time() + RESPONSE_SLACK
+        while self.process.poll() is None and time.time() < deadline:
+            time.sleep(0.01)
+        self.kill()
+        if self.process.returncode != HAL_EXIT_BOOT:
+            return False
+        with open(self.flash, 'rb') as f:
+            return f.read(len(image)) == image
+
+def buildProgram(program, bus_id=0, transport='UART'):
+    """
+    Build the native bootloader as program, with the given bus ID and
+    TRANSPORT.
+    """
+    with open(os.devnull, 'w') as devnull:
+        status = subprocess.call(['make', '-C', BOOTLOADER_DIR, 'native',
+                                  'NATIVE=' + program, 'BUS_ID={}'.format(bus_id),
+                                  'TRANSPORT=' + transport],
+                                 stdout=devnull)
+    if status != 0:
+        raise RuntimeError("ERROR: Building the native bootloader failed")
+    return program
+
+def randomBytes(size, seed=0):
+    rand = random.Random(seed)
+    return ''.join(chr(rand.getrandbits(8)) for i in range(size))
+
+def protectImage(segments, workdir, name='image', frame_pages=4):
+    """
+    Write an image made of segments, (address, data) pairs, to name.hex in
+    workdir and protect it as name.zip. Returns the protected file's path.
+    """
+    hexfile = IntelHex()
+    for start, data in segments:
+        for addr, c in enumerate(data, start):
+            hexfile[addr] = ord(c)
+    hexPath = os.path.join(workdir, name + '.hex')
+    with open(hexPath, 'w') as f:
+        hexfile.tofile(f, format='hex')
+
+    firmware = os.path.join(workdir, name + '.zip')
+    with open(os.devnull, 'w') as devnull:
+        status = subprocess.call([sys.executable, os.path.join(FILE_DIR, 'fw_protect'),
+                                  '--infile', hexPath, '--outfile', firmware,
+                                  '--version', '1', '--message', 'Test',
+                                  '--frame-pages', str(frame_pages)], stdout=devnull)
+    if status != 0:
+        raise RuntimeError("ERROR: fw_protect failed")
+    return firmware
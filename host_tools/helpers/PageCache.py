@@ -0,0 +1,94 @@
+#!/usr/bin/env python
+
+"""
+Cache of encrypted firmware pages for incremental fw_protect runs.
+
+An entry holds the IV and ciphertext fw_protect produced for a page, named by
+an HMAC (keyed with the AES key) of the cache format version, the cipher mode
+and the page's plaintext. A page whose contents have not changed since an
+earlier run under the same key therefore reuses that run's ciphertext, and
+entry names reveal nothing about the pages to anyone without the key.
+
+Tags are not cached: they also cover the page number and firmware version,
+which change between releases, and cost one MAC per page to recompute.
+
+Entries are written to a temporary file and renamed into place, so jobs
+sharing a cache directory never see a partial entry. An entry that cannot be
+read or has the wrong size is treated as a miss.
+"""
+
+import hashlib
+import hmac
+import os
+import tempfile
+
+from Crypt import PAGE_SIZE
+
+# Bump whenever the layout or meaning of an entry changes.
+CACHE_FORMAT = 1
+
+IV_SIZE = 16
+
+class PageCache:
+
+    def __init__(self, directory, key, mode):
+        self.directory = directory
+        self.key = key
+        self.mode = mode
+        self.hits = 0
+        self.misses = 0
+
+        if not os.path.isdir(directory):
+            try:
+                os.makedirs(directory)
+            except OSError:
+                # Another job created it first.
+                if not os.path.isdir(directory):
+                    raise
+
+    def __path(self, data):
+        name = hmac.new(self.key, '{}:{}:'.format(CACHE_FORMAT, self.mode) + data,
+                        hashlib.sha256).hexdigest()
+        return os.path.join(self.directory, name)
+
+    def get(self, data):
+        """
+        Return (ciphertext, iv) cached for the plaintext page data, or None.
+        """
+        try:
+            with open(self.__path(data), 'rb') as f:
+                entry = f.read()
+        except IOError:
+            entry = ''
+
+        if len(entry) != IV_SIZE + PAGE_SIZE:
+            self.misses += 1
+            return None
+
+        self.hits += 1
+        return (entry[IV_SIZE:], entry[:IV_SIZE])
+
+    def put(self, data, encPage, iv):
+        """
+        Store the encryption of the plaintext page data.
+        """
+        fd, tmp = tempfile.mkstemp(dir=self.directory, prefix='.tmp')
+        try:
+            with os.fdopen(fd, 'wb') as f:
+                f.write(iv + encPage)
+            os.rename(tmp, self.__path(data))
+        except:
+            os.unlink(tmp)
+            raise
+
+    def encode(self, data, encode):
+        """
+        Encrypt the plaintext page data with encode, unless it is cached.
+        """
+        cached = self.get(data)
+        if cached is not None:
+            return cached
+
+        encPage, iv = encode(data)
+        self.put(data, encPage, iv)
+        return (encPage, iv)
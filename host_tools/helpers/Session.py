@@ -0,0 +1,50 @@
+#!/usr/bin/env python
+
+"""
+Drives a bootloader started with both jumpers in place. Commands run back to
+back over one connection without resetting the part.
+"""
+
+import struct
+
+from Bootloader import Bootloader
+
+class Session(Bootloader):
+
+    def __init__(self, ser, debug=False):
+        Bootloader.__init__(self, ser, debug)
+        self.waitFor('S')
+
+    def command(self, cmd):
+        self.ser.write(cmd)
+        self.waitFor(cmd)
+
+    def status(self):
+        """
+        Return the installed firmware's version and size.
+        """
+        self.command('S')
+        self.expectOK()
+        version, size = struct.unpack('>HI', self.ser.read(6))
+        return {'version' : version, 'size' : size}
+
+    def update(self, firmware, frame_pages=None):
+        self.command('U')
+        return self.sendFirmware(firmware, frame_pages)
+
+    def readback(self, crypt, start_addr, num_bytes, flags=0):
+        self.command('R')
+        return self.readMemory(crypt, start_addr, num_bytes, flags)
+
+    def diff(self, crypt, start_addr, image):
+        """
+        Return the addresses of the pages that differ from image, by digest.
+        """
+        self.command('R')
+        return self.diffMemory(crypt, start_addr, image)
+
+    def boot(self):
+        """
+        Leave the session and start the application.
+        """
+        self.command('B')
@@ -0,0 +1,121 @@
+#!/usr/bin/env python
+
+"""
+Per-frame timing trace of an update or readback.
+
+Every frame sent to the bootloader is recorded with three timestamps: when
+the write started, when the serial port had sent the last byte, and when the
+bootloader's response arrived, or when the wait for it timed out. Frames that
+timed out are recorded as their own kind. Every readback page received is
+recorded with when the read started, when its first byte arrived and when its
+last byte arrived. Resent frames get a record per attempt.
+
+Traces are saved as a short header followed by fixed-size binary records
+with timestamps in microseconds from the start of the trace. Running this
+module on a saved trace prints its summary:
+
+    python helpers/Trace.py update.trace
+"""
+
+import struct
+import sys
+import time
+
+MAGIC = 'BLTRACE1'
+
+KIND_FRAME = 'F'
+KIND_TIMEOUT = 'T'
+KIND_PAGE = 'P'
+
+# Kind, response byte (answered frames only), size in bytes and three
+# timestamps.
+RECORD = struct.Struct('>ccIIII')
+
+class Trace:
+
+    def __init__(self):
+        self.start = time.time()
+        self.records = []
+
+    def now(self):
+        return time.time() - self.start
+
+    def add(self, kind, size, t0, t1, t2, resp='\0'):
+        self.records.append((kind, resp, size, t0, t1, t2))
+
+    def save(self, path):
+        with open(path, 'wb') as f:
+            f.write(MAGIC)
+            for kind, resp, size, t0, t1, t2 in self.records:
+                f.write(RECORD.pack(kind, resp or '\0', size,
+                                    int(t0 * 1e6), int(t1 * 1e6), int(t2 * 1e6)))
+
+    @staticmethod
+    def load(path):
+        trace = Trace()
+        with open(path, 'rb') as f:
+            if f.read(len(MAGIC)) != MAGIC:
+                raise RuntimeError("ERROR: {} is not a trace file".format(path))
+
+            while True:
+                record = f.read(RECORD.size)
+                if len(record) < RECORD.size:
+                    break
+                kind, resp, size, t0, t1, t2 = RECORD.unpack(record)
+                trace.add(kind, size, t0 / 1e6, t1 / 1e6, t2 / 1e6, resp)
+
+        return trace
+
+    def summary(self):
+        if not self.records:
+            return "Trace is empty."
+
+        lines = []
+        frames = [r for r in self.records if r[0] in (KIND_FRAME, KIND_TIMEOUT)]
+        answered = [r for r in frames if r[0] == KIND_FRAME]
+        pages = [r for r in self.records if r[0] == KIND_PAGE]
+
+        if frames:
+            nak = sum(1 for r in answered if r[1] == '\x02')
+            lines.append("Frames sent: {} ({} NAKed, {} unanswered), {} bytes".format(
+                len(frames), nak, len(frames) - len(answered), sum(r[2] for r in frames)))
+            if answered:
+                lines.append("  write start to response (ms): " +
+                             percentiles([r[5] - r[3] for r in answered]))
+            # After the last byte is out, the host can only wait.
+            lines.append(stalled("  stalled on responses", frames, 4, 5))
+
+        if pages:
+            lines.append("Pages received: {}, {} bytes".format(
+                len(pages), sum(r[2] for r in pages)))
+            lines.append("  read start to last byte (ms): " +
+                         percentiles([r[5] - r[3] for r in pages]))
+            lines.append(stalled("  stalled on first byte", pages, 3, 4))
+
+        elapsed = self.records[-1][5] - self.records[0][3]
+        total = sum(r[2] for r in self.records)
+        busy = sum(r[5] - r[3] for r in self.records)
+        lines.append("Host time between frames: {:.2f}s".format(elapsed - busy))
+        lines.append("Effective rate: {:.0f} bytes/s over {:.2f}s".format(
+            total / elapsed if elapsed > 0 else 0, elapsed))
+
+        return '\n'.join(lines)
+
+def percentiles(values):
+    values = sorted(values)
+    picks = []
+    for name, p in (('p50', 50), ('p90', 90), ('p99', 99)):
+        # Nearest rank.
+        rank = max(0, (p * len(values) + 99) // 100 - 1)
+        picks.append('{} {:.1f}'.format(name, values[rank] * 1e3))
+    picks.append('max {:.1f}'.format(values[-1] * 1e3))
+    return '  '.join(picks)
+
+def stalled(label, records, begin, end):
+    stall = sum(r[end] - r[begin] for r in records)
+    total = sum(r[5] - r[3] for r in records)
+    share = 100 * stall / total if total > 0 else 0
+    return "{}: {:.2f}s ({:.0f}% of transfer time)".format(label, stall, share)
+
+if __name__ == '__main__':
+    print(Trace.load(sys.argv[1]).summary())
@@ -0,0 +1,197 @@
+#!/usr/bin/env python
+
+"""
+Links the host tools can reach the bootloader over, matching its TRANSPORT
+build setting.
+
+A Transport looks like the subset of a pyserial port the tools use: read(),
+write(), flush(), flushInput() and a read timeout in seconds. It also gives
+transmitTime(), the seconds a number of bytes take to send, which Bootloader
+uses to set its response timeouts. A pyserial port wrapped in
+SerialTransport is the UART transport.
+
+SpiTransport talks to a TRANSPORT=SPI bootloader through an SPI master
+bridge. The bootloader toggles its READY line once for every byte it is ready
+to exchange, and SpiTransport clocks exactly one byte per toggle: the byte it
+sends when writing, a dummy 0x00 when reading. A bridge only needs transfer()
+(one full-duplex byte) and ready() (the READY level). SpidevBridge is one
+built from Linux spidev and a sysfs GPIO; LinkBridge drives the simulated SPI
+bus of a native build (make native TRANSPORT=SPI, see hal_linux.c).
+"""
+
+import time
+
+# READY is polled this often while waiting for the bootloader.
+READY_POLL = 0.0001
+
+class Transport(object):
+
+    def read(self, size=1):
+        raise NotImplementedError
+
+    def write(self, data):
+        raise NotImplementedError
+
+    def flush(self):
+        pass
+
+    def flushInput(self):
+        pass
+
+    def transmitTime(self, size):
+        raise NotImplementedError
+
+class SerialTransport(Transport):
+    """
+    The UART transport: a pyserial port. Anything else is passed through to
+    the port.
+    """
+
+    def __init__(self, ser):
+        self.__dict__['ser'] = ser
+
+    def __getattr__(self, name):
+        return getattr(self.ser, name)
+
+    def __setattr__(self, name, value):
+        setattr(self.ser, name, value)
+
+    @property
+    def timeout(self):
+        return self.ser.timeout
+
+    def read(self, size=1):
+        return self.ser.read(size)
+
+    def write(self, data):
+        return self.ser.write(data)
+
+    def flush(self):
+        self.ser.flush()
+
+    def flushInput(self):
+        self.ser.flushInput()
+
+    def transmitTime(self, size):
+        # A start bit, eight data bits and a stop bit.
+        return size * 10.0 / self.ser.baudrate
+
+class SpiTransport(Transport):
+    """
+    The SPI transport, over bridge clocked at hz.
+    """
+
+    def __init__(self, bridge, hz, timeout=None):
+        self.bridge = bridge
+        self.hz = hz
+        self.timeout = timeout
+        self.level = bridge.ready()
+
+    def __waitReady(self, deadline):
+        """
+        Wait for READY to toggle. False if deadline passes first. A
+        bootloader reset also changes READY, and the byte then clocked is
+        lost, which only matters while waiting for its banner.
+        """
+        while True:
+            level = self.bridge.ready()
+            if level != self.level:
+                self.level = level
+                return True
+            if deadline is not None and time.time() > deadline:
+                return False
+            time.sleep(READY_POLL)
+
+    def __deadline(self):
+        return None if self.timeout is None else time.time() + self.timeout
+
+    def read(self, size=1):
+        deadline = self.__deadline()
+        data = ''
+        while len(data) < size and self.__waitReady(deadline):
+            data += chr(self.bridge.transfer(0))
+        return data
+
+    def write(self, data):
+        deadline = self.__deadline()
+        for c in data:
+            if not self.__waitReady(deadline):
+                raise RuntimeError("ERROR: Bootloader stopped taking bytes over SPI.")
+            self.bridge.transfer(ord(c))
+        return len(data)
+
+    def transmitTime(self, size):
+        # The bridge's own per-byte overhead is covered by RESPONSE_SLACK.
+        return size * 8.0 / self.hz
+
+class SpidevBridge:
+    """
+    An SPI master from Linux spidev (SPI mode 0), with READY read from a
+    sysfs GPIO that is already exported as an input.
+    """
+
+    def __init__(self, device, ready_gpio, hz):
+        import spidev
+
+        bus, dev = device.replace('/dev/spidev', '').split('.')
+        self.spi = spidev.SpiDev()
+        self.spi.open(int(bus), int(dev))
+        self.spi.mode = 0
+        self.spi.max_speed_hz = hz
+        self.gpio = open('/sys/class/gpio/gpio{}/value'.format(ready_gpio), 'r')
+
+    def transfer(self, byte):
+        return self.spi.xfer2([byte])[0]
+
+    def ready(self):
+        self.gpio.seek(0)
+        return self.gpio.read(1) == '1'
+
+class LinkBridge:
+    """
+    The SPI master on a native TRANSPORT=SPI bootloader's simulated bus, the
+    port it opened for UART1. Each byte written clocks a transfer, answered
+    with 'D' and the bootloader's byte; 'R' marks each toggle of READY, which
+    starts low.
+    """
+
+    def __init__(self, port):
+        import serial
+
+        self.ser = serial.Serial(port, baudrate=9600, timeout=1)
+        self.level = False
+
+    def __toggled(self, c):
+        if c == 'R':
+            self.level = not self.level
+        return c == 'R'
+
+    def transfer(self, byte):
+        self.ser.write(chr(byte))
+        c = self.ser.read(1)
+        while self.__toggled(c):
+            c = self.ser.read(1)
+        if c != 'D':
+            raise RuntimeError("ERROR: No answer on the SPI link.")
+        return ord(self.ser.read(1))
+
+    def ready(self):
+        # Transfers are answered before transfer() returns, so only toggles
+        # can be waiting.
+        while self.ser.in_waiting:
+            self.__toggled(self.ser.read(1))
+        return self.level
+
+def openTransport(port=None, spi=None, ready=None, hz=4000000, timeout=3, link=None):
+    """
+    Open the serial port port at 9600 baud, the SPI transport through the
+    spidev device spi with READY on GPIO ready, or the SPI transport over a
+    native build's simulated bus on the port link.
+    """
+    if spi:
+        return SpiTransport(SpidevBridge(spi, ready, hz), hz, timeout)
+    if link:
+        return SpiTransport(LinkBridge(link), hz, timeout)
+
+    import serial
+    return SerialTransport(serial.Serial(port, baudrate=9600, timeout=timeout))